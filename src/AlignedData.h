@@ -1,10 +1,54 @@
 #pragma once
 
+#include <cstdint>
+#include <cstddef>
+#include <new>
+
+// Offsets are relative to the centre cell data[data_size / 2], so they always fit in a signed byte
 template<uint_fast32_t data_size>
 struct AlignedData
 {
-	/*alignas(16)*/ uint8_t data[data_size];
-	int_fast32_t idx;
-	int_fast32_t start;
-	int_fast32_t end;
+	static_assert(data_size <= 128, "AlignedData offsets are stored as int8_t");
+
+	alignas(16) uint8_t data[data_size];
+	int8_t idx;
+	int8_t start;
+	int8_t end;
+};
+
+// Compact form of the AlignedData entries kept in the cache, one column per field
+// Only the bytes of entry e in [start[e], end[e]) are stored, at windows + offset[e]
+struct EffectColumns
+{
+	const uint32_t* offset;
+	const int8_t* idx;
+	const int8_t* start;
+	const int8_t* end;
+	const uint8_t* windows;
+};
+
+// Starts every allocation on its own cache line
+template<typename T>
+struct CacheLineAllocator
+{
+	typedef T value_type;
+	static const size_t alignment = 64;
+
+	CacheLineAllocator() = default;
+	template<typename U>
+	CacheLineAllocator(const CacheLineAllocator<U>&) {}
+
+	T* allocate(size_t count)
+	{
+		return static_cast<T*>(::operator new(count * sizeof(T), std::align_val_t(alignment)));
+	}
+	void deallocate(T* pointer, size_t)
+	{
+		::operator delete(pointer, std::align_val_t(alignment));
+	}
+
+	template<typename U>
+	bool operator==(const CacheLineAllocator<U>&) const { return true; }
+	template<typename U>
+	bool operator!=(const CacheLineAllocator<U>&) const { return false; }
 };
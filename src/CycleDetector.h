@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include "Util.h"
+
+// Brent's cycle detection over the states of an execution: the state at the last power of two jumps is kept and compared
+// with each state after it. A state coming back means the execution never ends and would only run out of jumps
+template<uint_fast32_t tape_size>
+class CycleDetector
+{
+public:
+	inline void Reset()
+	{
+		programIdx = UINT_FAST32_MAX;
+		length = 0;
+		power = 1;
+	}
+
+	// Tape cells outside [low, high) are zero, and the bounds only grow between Reset calls, so the saved ones are within them
+	// An empty range, with low at or past high, means the whole tape is zero
+	// progress is any other state the execution carries, such as how much of the target output it has matched
+	inline bool Cycled(uint_fast32_t programIdx, uint_fast32_t dataIdx, uint_fast32_t progress, const uint8_t* tape, uint_fast32_t low, uint_fast32_t high)
+	{
+		if (programIdx == this->programIdx && dataIdx == this->dataIdx && progress == this->progress && TapeEqual(tape, low, high))
+		{
+			return true;
+		}
+
+		if (++length == power)
+		{
+			this->programIdx = programIdx;
+			this->dataIdx = dataIdx;
+			this->progress = progress;
+			this->low = low;
+			this->high = high;
+			if (low < high)
+			{
+				memcpy(data + low, tape + low, high - low);
+			}
+			power *= 2;
+			length = 0;
+		}
+		return false;
+	}
+
+private:
+	inline bool TapeEqual(const uint8_t* tape, uint_fast32_t low, uint_fast32_t high)
+	{
+		if (low >= high)
+		{
+			return this->low >= this->high;
+		}
+		if (this->low >= this->high)
+		{
+			return FindFirst<false>(tape, low, high) == high;
+		}
+		return memcmp(tape + this->low, data + this->low, this->high - this->low) == 0 &&
+			FindFirst<false>(tape, low, this->low) == this->low &&
+			FindFirst<false>(tape, this->high, high) == high;
+	}
+
+	uint_fast32_t programIdx;
+	uint_fast32_t dataIdx;
+	uint_fast32_t progress;
+	uint_fast32_t low;
+	uint_fast32_t high;
+	uint_fast32_t length;
+	uint_fast32_t power;
+	uint8_t data[tape_size];
+};
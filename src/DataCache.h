@@ -2,28 +2,63 @@
 
 #include <cstring>
 #include <vector>
-#include <unordered_set>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
 #include <iostream>
 #include <iomanip>
 #include <string>
-
-#include "LookupData.h"
+#include <fstream>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "EffectSet.h"
 #include "AlignedData.h"
 #include "Util.h"
 
+// Number of independently locked dedupe tables used while building a cache size
+#define CACHE_SHARD_COUNT 64
+// Directory holding prebuilt cache images; comment out to always build the cache in memory
+#define CACHE_IMAGE_DIRECTORY "/home/ksabry/dev/bfbrute/cache"
+// Bump whenever the image layout or the contents of a built cache change
+#define CACHE_IMAGE_VERSION 5
+// Bump whenever the order of the entries in a bucket or the programs kept for them change; search progress is stored as ranks over this order
+#define CACHE_ORDER_VERSION 2
+// How many entries ahead of the current one LinearIterator prefetches while walking a bucket
+#define CACHE_PREFETCH_DISTANCE 8
+// Largest number of frame pairs a two frame segment length may have for its duplicate composites to be marked
+// At cache size 12 this covers segments of 13 to 17 instructions; longer ones are deduplicated by LinearIterator as it walks them
+#define COMPOSITE_MASK_MAX_PAIRS (1ull << 26)
+// Most composites LinearIterator remembers per walk of a segment without a mask; later ones are walked without checking for repeats
+#define COMPOSITE_SET_MAX_ENTRIES (1u << 18)
+
 // NOTE: for efficiency data_size should be a multiple of 4 minus 1
 template<uint_fast32_t data_size, uint_fast32_t max_cache_size>
 class DataCache
 {
 public:
 	DataCache()
-		: dataBalancedCount(0), dataUnbalancedCount(0)
+		: identity(NextIdentity()), dataBalancedCount(0), dataUnbalancedCount(0),
+		columnsBalanced(), columnsUnbalanced(),
+		programsBalanced(nullptr), programsUnbalanced(nullptr),
+		image(nullptr), imageSize(0)
 	{
 	}
 	~DataCache()
 	{
+		if (image != nullptr)
+			munmap(image, imageSize);
 	}
 
+	static const uint_fast32_t cache_size = max_cache_size;
+
+	// Distinct for every cache constructed by this process, unlike its address, which a later cache may reuse
+	uint_fast64_t identity;
+
 	uint_fast32_t zeroDataIdx = data_size / 2;
 	int_fast32_t lowDataIdx = -static_cast<int_fast32_t>(data_size) / 2;
 	int_fast32_t highDataIdx = static_cast<int_fast32_t>(data_size) + lowDataIdx;
@@ -31,25 +66,231 @@ public:
 	uint_fast32_t dataBalancedCount;
 	uint_fast32_t dataUnbalancedCount;
 
-	std::vector<AlignedData<data_size>> dataBalanced;
-	std::vector<AlignedData<data_size>> dataUnbalanced;
+	// Point either into the build buffers below or into a read-only mapped cache image
+	// The hot columns and windows start on cache lines; program text is only read when printing a result
+	EffectColumns columnsBalanced;
+	EffectColumns columnsUnbalanced;
 
-	std::vector<char> programsBalanced;
-	std::vector<char> programsUnbalanced;
+	const char* programsBalanced;
+	const char* programsUnbalanced;
 
 	uint_fast32_t bordersBalanced[max_cache_size + 2];
 	uint_fast32_t bordersUnbalanced[max_cache_size + 2];
 
+	// Each size bucket is sorted by (idx sign, centre cell, start, end); these mark where each centre cell value begins
+	// Unbalanced buckets hold every negative idx entry before the positive ones, so centreBordersPositive[size][0] is the sign border
+	uint_fast32_t centreBordersBalanced[max_cache_size + 1][257];
+	uint_fast32_t centreBordersNegative[max_cache_size + 1][257];
+	uint_fast32_t centreBordersPositive[max_cache_size + 1][257];
+
 	void Create()
 	{
-		CreateZero();
-		CreateOne();
-		for (uint_fast32_t size = 2; size <= max_cache_size; size++)
+		uint_fast32_t createdSize = 1;
+#ifdef CACHE_IMAGE_DIRECTORY
+		std::string filename = ImageFilename();
+		if (Load(filename))
+		{
+			std::cout << " Loaded cache image " << filename << std::endl;
+			CreateCentreBorders();
+			return;
+		}
+
+		// The largest smaller image saves rebuilding every size it already holds
+		for (uint_fast32_t size = max_cache_size - 1; size >= 2 && createdSize == 1; size--)
+		{
+			if (Extend(ImageFilename(size), size))
+			{
+				createdSize = size;
+				std::cout << " Extending cache image " << ImageFilename(size) << std::endl;
+			}
+		}
+#endif
+
+		if (createdSize == 1)
+		{
+			CreateZero();
+			CreateOne();
+		}
+		for (uint_fast32_t size = createdSize + 1; size <= max_cache_size; size++)
 		{
 			CreateSize(size);
 			std::cout << " Created cache size " << size << " / " << max_cache_size << "\r" << std::flush;
 		}
 		std::cout << std::endl;
+		// Only needed while building; the search never looks effects up by value
+		dataSet.Clear();
+		UseBuffers();
+		CreateCentreBorders();
+
+#ifdef CACHE_IMAGE_DIRECTORY
+		if (Save(filename))
+			std::cout << " Saved cache image " << filename << std::endl;
+		else
+			std::cout << " Failed to save cache image " << filename << std::endl;
+#endif
+	}
+
+	std::string ImageFilename(uint_fast32_t cacheSize = max_cache_size)
+	{
+#ifdef CACHE_IMAGE_DIRECTORY
+		return std::string(CACHE_IMAGE_DIRECTORY) + "/data_cache_" + std::to_string(data_size) + "_" + std::to_string(cacheSize);
+#else
+		return std::string();
+#endif
+	}
+
+	// Maps a previously saved image read-only; the pages are shared between every process using the same image
+	bool Load(const std::string& filename)
+	{
+		size_t size;
+		const ImageHeader* header = MapImage(filename, size);
+		if (header == nullptr)
+			return false;
+		if (header->maxCacheSize != max_cache_size)
+		{
+			munmap(const_cast<ImageHeader*>(header), size);
+			return false;
+		}
+
+		if (image != nullptr)
+			munmap(image, imageSize);
+		image = const_cast<ImageHeader*>(header);
+		imageSize = size;
+
+		dataBalancedCount = header->balancedCount;
+		dataUnbalancedCount = header->unbalancedCount;
+		RestoreBorders(header);
+		columnsBalanced = ImageColumns(header, true);
+		columnsUnbalanced = ImageColumns(header, false);
+		programsBalanced = header->Section(SECTION_PROGRAMS_BALANCED);
+		programsUnbalanced = header->Section(SECTION_PROGRAMS_UNBALANCED);
+		return true;
+	}
+
+	// Copies in an image built with a smaller max_cache_size and restores the dedupe set over it, leaving only the larger sizes to create
+	bool Extend(const std::string& filename, uint_fast32_t storedSize)
+	{
+		size_t size;
+		const ImageHeader* header = MapImage(filename, size);
+		if (header == nullptr)
+			return false;
+		if (header->maxCacheSize != storedSize || storedSize >= max_cache_size)
+		{
+			munmap(const_cast<ImageHeader*>(header), size);
+			return false;
+		}
+
+		dataBalancedCount = header->balancedCount;
+		dataUnbalancedCount = header->unbalancedCount;
+		RestoreBorders(header);
+		RestoreBuffers(header, true);
+		RestoreBuffers(header, false);
+		munmap(const_cast<ImageHeader*>(header), size);
+		UseBuffers();
+
+		dataSet.Reserve(dataBalancedCount + dataUnbalancedCount);
+		AlignedData<data_size> entry;
+		for (uint_fast32_t e = 0; e < dataBalancedCount; e++)
+		{
+			GetData(true, e, entry);
+			dataSet.FindOrInsert(EffectHash<data_size>(entry.idx, entry.data), EntryKey(true, e), [](uint32_t) { return false; });
+		}
+		for (uint_fast32_t e = 0; e < dataUnbalancedCount; e++)
+		{
+			GetData(false, e, entry);
+			dataSet.FindOrInsert(EffectHash<data_size>(entry.idx, entry.data), EntryKey(false, e), [](uint32_t) { return false; });
+		}
+		return true;
+	}
+
+	// Writes to a temporary file and renames it into place so concurrent readers never see a partial image
+	bool Save(const std::string& filename)
+	{
+		ImageHeader header;
+		header.Init(dataBalancedCount, dataUnbalancedCount, buffersBalanced.windows.size(), buffersUnbalanced.windows.size());
+		uint64_t borders[2 * (max_cache_size + 2)];
+		for (uint_fast32_t i = 0; i < max_cache_size + 2; i++)
+		{
+			borders[i] = bordersBalanced[i];
+			borders[max_cache_size + 2 + i] = bordersUnbalanced[i];
+		}
+
+		std::string tempFilename = filename + ".tmp" + std::to_string(getpid());
+		std::ofstream file(tempFilename, std::ofstream::binary | std::ofstream::trunc);
+		if (!file.good())
+			return false;
+
+		const void* sections[SECTION_COUNT] = {
+			borders,
+			columnsBalanced.offset, columnsBalanced.idx, columnsBalanced.start, columnsBalanced.end, columnsBalanced.windows,
+			columnsUnbalanced.offset, columnsUnbalanced.idx, columnsUnbalanced.start, columnsUnbalanced.end, columnsUnbalanced.windows,
+			programsBalanced, programsUnbalanced
+		};
+		WriteAt(file, 0, &header, sizeof(ImageHeader));
+		for (uint_fast32_t section = 0; section < SECTION_COUNT; section++)
+			WriteAt(file, header.SectionOffset(section), sections[section], header.SectionSize(section));
+		bool written = file.good();
+		file.close();
+
+		if (!written || rename(tempFilename.c_str(), filename.c_str()) != 0)
+		{
+			remove(tempFilename.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	inline void GetData(bool balanced, uint_fast32_t index, AlignedData<data_size>& result) const
+	{
+		ExpandWindow<data_size>(result, Columns(balanced), index);
+	}
+
+	inline const EffectColumns& Columns(bool balanced) const
+	{
+		return balanced ? columnsBalanced : columnsUnbalanced;
+	}
+
+	// Value of the cell the entry started on
+	inline uint8_t Centre(bool balanced, uint_fast32_t index) const
+	{
+		const EffectColumns& columns = Columns(balanced);
+		if (columns.start[index] > 0 || columns.end[index] <= 0)
+			return 0;
+		return columns.windows[columns.offset[index] - columns.start[index]];
+	}
+
+	// Pulls in the window of an entry about to be expanded
+	inline void Prefetch(bool balanced, uint_fast32_t index) const
+	{
+		const EffectColumns& columns = Columns(balanced);
+		__builtin_prefetch(columns.windows + columns.offset[index]);
+	}
+
+	inline const uint_fast32_t* CentreBorders(bool balanced, bool negative, uint_fast32_t size) const
+	{
+		return balanced ? centreBordersBalanced[size] : negative ? centreBordersNegative[size] : centreBordersPositive[size];
+	}
+
+	// Position of an entry within its size bucket, in the balanced then unbalanced order the iterators walk it
+	inline uint_fast64_t BucketPosition(bool balanced, uint_fast32_t index, uint_fast32_t size) const
+	{
+		return balanced ? index - bordersBalanced[size] : bordersBalanced[size + 1] - bordersBalanced[size] + index - bordersUnbalanced[size];
+	}
+
+	// Inverse of BucketPosition
+	inline void BucketEntry(uint_fast32_t size, uint_fast64_t position, bool& balanced, uint_fast32_t& index) const
+	{
+		uint_fast64_t balancedCount = bordersBalanced[size + 1] - bordersBalanced[size];
+		balanced = position < balancedCount;
+		index = balanced ? bordersBalanced[size] + position : bordersUnbalanced[size] + position - balancedCount;
+	}
+
+	// Segments of max_cache_size + size are walked as pairs of a max_cache_size entry followed by a size entry
+	// Bit leftPosition * SizeCount(size) + rightPosition is set for the first pair giving each composite effect; nullptr if there are too many pairs to mark
+	const uint64_t* CompositeMask(uint_fast32_t size)
+	{
+		std::call_once(compositeMaskOnce[size], [&]() { CreateCompositeMask(size); });
+		return compositeMasks[size].empty() ? nullptr : compositeMasks[size].data();
 	}
 
 	uint_fast64_t SizeCount(uint_fast32_t size)
@@ -58,7 +299,271 @@ public:
 	}
 
 private:
-	std::unordered_set<LookupData<data_size>> dataSet;
+	static uint_fast64_t NextIdentity()
+	{
+		static std::atomic<uint_fast64_t> next(0);
+		return next++;
+	}
+
+	template<typename T>
+	using Column = std::vector<T, CacheLineAllocator<T>>;
+
+	// Growable backing store of one EffectColumns while the cache is built
+	struct ColumnBuffers
+	{
+		Column<uint32_t> offset;
+		Column<int8_t> idx;
+		Column<int8_t> start;
+		Column<int8_t> end;
+		Column<uint8_t> windows;
+
+		void Use(EffectColumns& columns) const
+		{
+			columns.offset = offset.data();
+			columns.idx = idx.data();
+			columns.start = start.data();
+			columns.end = end.data();
+			columns.windows = windows.data();
+		}
+	};
+
+	ColumnBuffers buffersBalanced;
+	ColumnBuffers buffersUnbalanced;
+
+	std::vector<char> programsBalancedBuffer;
+	std::vector<char> programsUnbalancedBuffer;
+
+	void* image;
+	size_t imageSize;
+
+	std::vector<uint64_t> compositeMasks[max_cache_size + 1];
+	std::once_flag compositeMaskOnce[max_cache_size + 1];
+
+	void CreateCompositeMask(uint_fast32_t size)
+	{
+		uint_fast64_t leftCount = SizeCount(max_cache_size);
+		uint_fast64_t rightCount = SizeCount(size);
+		if (size == 0 || leftCount * rightCount > COMPOSITE_MASK_MAX_PAIRS)
+			return;
+
+		// Entries in bucket position order
+		auto entryAt = [&](uint_fast32_t entrySize, uint_fast64_t position, AlignedData<data_size>& entry)
+		{
+			bool balanced;
+			uint_fast32_t index;
+			BucketEntry(entrySize, position, balanced, index);
+			GetData(balanced, index, entry);
+		};
+
+		std::vector<AlignedData<data_size>> right(rightCount);
+		for (uint_fast64_t rightPosition = 0; rightPosition < rightCount; rightPosition++)
+			entryAt(size, rightPosition, right[rightPosition]);
+
+		std::vector<uint64_t>& mask = compositeMasks[size];
+		mask.assign((leftCount * rightCount + 63) / 64, 0);
+
+		EffectSet composites;
+		AlignedData<data_size> left, composite, otherLeft, otherComposite;
+		for (uint_fast64_t leftPosition = 0; leftPosition < leftCount; leftPosition++)
+		{
+			entryAt(max_cache_size, leftPosition, left);
+			for (uint_fast64_t rightPosition = 0; rightPosition < rightCount; rightPosition++)
+			{
+				uint32_t pair = leftPosition * rightCount + rightPosition;
+
+				// Pairs leaving the data window are kept just as the iterator always walked them
+				if (ComposeData(left, right[rightPosition], composite))
+				{
+					uint32_t found = composites.FindOrInsert(EffectHash<data_size>(composite.idx, composite.data), pair, [&](uint32_t other)
+					{
+						entryAt(max_cache_size, other / rightCount, otherLeft);
+						ComposeData(otherLeft, right[other % rightCount], otherComposite);
+						return otherComposite.idx == composite.idx && memcmp(otherComposite.data, composite.data, data_size) == 0;
+					});
+					if (found != pair)
+						continue;
+				}
+				mask[pair / 64] |= static_cast<uint64_t>(1) << (pair % 64);
+			}
+		}
+	}
+
+	static inline uint_fast64_t AlignImageOffset(uint_fast64_t offset)
+	{
+		return (offset + 63) & ~static_cast<uint_fast64_t>(63);
+	}
+
+	// Image sections in file order; the cold program text goes last
+	// The columns of each bucket type must stay in EffectColumns order, ImageColumns relies on it
+	enum ImageSection
+	{
+		SECTION_BORDERS,
+		SECTION_OFFSET_BALANCED, SECTION_IDX_BALANCED, SECTION_START_BALANCED, SECTION_END_BALANCED, SECTION_WINDOWS_BALANCED,
+		SECTION_OFFSET_UNBALANCED, SECTION_IDX_UNBALANCED, SECTION_START_UNBALANCED, SECTION_END_UNBALANCED, SECTION_WINDOWS_UNBALANCED,
+		SECTION_PROGRAMS_BALANCED, SECTION_PROGRAMS_UNBALANCED,
+		SECTION_COUNT
+	};
+
+	// Fixed-width header at the start of an image, the same for every max_cache_size; every section after it starts on a 64 byte boundary
+	struct ImageHeader
+	{
+		char magic[8];
+		uint64_t version;
+		uint64_t dataSize;
+		uint64_t maxCacheSize;
+		uint64_t balancedCount;
+		uint64_t unbalancedCount;
+		uint64_t windowsBalancedSize;
+		uint64_t windowsUnbalancedSize;
+
+		void Init(uint64_t balancedCount, uint64_t unbalancedCount, uint64_t windowsBalancedSize, uint64_t windowsUnbalancedSize)
+		{
+			memset(this, 0, sizeof(ImageHeader));
+			memcpy(magic, "BFCACHE", 8);
+			version = CACHE_IMAGE_VERSION;
+			dataSize = data_size;
+			maxCacheSize = max_cache_size;
+			this->balancedCount = balancedCount;
+			this->unbalancedCount = unbalancedCount;
+			this->windowsBalancedSize = windowsBalancedSize;
+			this->windowsUnbalancedSize = windowsUnbalancedSize;
+		}
+
+		bool Matches() const
+		{
+			return memcmp(magic, "BFCACHE", 8) == 0
+				&& version == CACHE_IMAGE_VERSION
+				&& dataSize == data_size;
+		}
+
+		// Program text is stored at a maxCacheSize stride
+		uint_fast64_t ProgramsSize(uint_fast64_t count) const
+		{
+			return count * maxCacheSize + 1;
+		}
+
+		uint_fast64_t SectionSize(uint_fast32_t section) const
+		{
+			switch (section)
+			{
+			case SECTION_BORDERS: return 2 * (maxCacheSize + 2) * sizeof(uint64_t);
+			case SECTION_OFFSET_BALANCED: return balancedCount * sizeof(uint32_t);
+			case SECTION_OFFSET_UNBALANCED: return unbalancedCount * sizeof(uint32_t);
+			case SECTION_WINDOWS_BALANCED: return windowsBalancedSize;
+			case SECTION_WINDOWS_UNBALANCED: return windowsUnbalancedSize;
+			case SECTION_PROGRAMS_BALANCED: return ProgramsSize(balancedCount);
+			case SECTION_PROGRAMS_UNBALANCED: return ProgramsSize(unbalancedCount);
+			default: return section < SECTION_OFFSET_UNBALANCED ? balancedCount : unbalancedCount;
+			}
+		}
+
+		uint_fast64_t SectionOffset(uint_fast32_t section) const
+		{
+			uint_fast64_t offset = AlignImageOffset(sizeof(ImageHeader));
+			for (uint_fast32_t i = 0; i < section; i++)
+				offset = AlignImageOffset(offset + SectionSize(i));
+			return offset;
+		}
+
+		uint_fast64_t Size() const { return SectionOffset(SECTION_PROGRAMS_UNBALANCED) + SectionSize(SECTION_PROGRAMS_UNBALANCED); }
+
+		const char* Section(uint_fast32_t section) const
+		{
+			return reinterpret_cast<const char*>(this) + SectionOffset(section);
+		}
+	};
+
+	// Maps an image read-only if it has this layout and data_size, whatever its max_cache_size
+	static const ImageHeader* MapImage(const std::string& filename, size_t& size)
+	{
+		int fd = open(filename.c_str(), O_RDONLY);
+		if (fd < 0)
+			return nullptr;
+
+		struct stat fileStat;
+		if (fstat(fd, &fileStat) != 0 || static_cast<size_t>(fileStat.st_size) < sizeof(ImageHeader))
+		{
+			close(fd);
+			return nullptr;
+		}
+
+		size = fileStat.st_size;
+		void* mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mapped == MAP_FAILED)
+			return nullptr;
+
+		const ImageHeader* header = static_cast<const ImageHeader*>(mapped);
+		if (!header->Matches() || size != header->Size())
+		{
+			munmap(mapped, size);
+			return nullptr;
+		}
+		return header;
+	}
+
+	static EffectColumns ImageColumns(const ImageHeader* header, bool balanced)
+	{
+		uint_fast32_t first = balanced ? SECTION_OFFSET_BALANCED : SECTION_OFFSET_UNBALANCED;
+		EffectColumns columns;
+		columns.offset = reinterpret_cast<const uint32_t*>(header->Section(first));
+		columns.idx = reinterpret_cast<const int8_t*>(header->Section(first + 1));
+		columns.start = reinterpret_cast<const int8_t*>(header->Section(first + 2));
+		columns.end = reinterpret_cast<const int8_t*>(header->Section(first + 3));
+		columns.windows = reinterpret_cast<const uint8_t*>(header->Section(first + 4));
+		return columns;
+	}
+
+	// Sizes beyond the image's own max cache size are left for CreateSize
+	void RestoreBorders(const ImageHeader* header)
+	{
+		const uint64_t* borders = reinterpret_cast<const uint64_t*>(header->Section(SECTION_BORDERS));
+		for (uint_fast32_t i = 0; i < header->maxCacheSize + 2; i++)
+		{
+			bordersBalanced[i] = borders[i];
+			bordersUnbalanced[i] = borders[header->maxCacheSize + 2 + i];
+		}
+	}
+
+	void RestoreBuffers(const ImageHeader* header, bool balanced)
+	{
+		ColumnBuffers& buffers = balanced ? buffersBalanced : buffersUnbalanced;
+		std::vector<char>& programs = balanced ? programsBalancedBuffer : programsUnbalancedBuffer;
+		uint_fast64_t count = balanced ? header->balancedCount : header->unbalancedCount;
+
+		EffectColumns columns = ImageColumns(header, balanced);
+		buffers.offset.assign(columns.offset, columns.offset + count);
+		buffers.idx.assign(columns.idx, columns.idx + count);
+		buffers.start.assign(columns.start, columns.start + count);
+		buffers.end.assign(columns.end, columns.end + count);
+		buffers.windows.assign(columns.windows, columns.windows + header->SectionSize(balanced ? SECTION_WINDOWS_BALANCED : SECTION_WINDOWS_UNBALANCED));
+
+		// Restride the program text from the image's max cache size to this one
+		const char* stored = header->Section(balanced ? SECTION_PROGRAMS_BALANCED : SECTION_PROGRAMS_UNBALANCED);
+		programs.assign(count * max_cache_size + 1, '\0');
+		for (uint_fast64_t e = 0; e < count; e++)
+		{
+			const char* program = stored + e * header->maxCacheSize;
+			memcpy(&programs[e * max_cache_size], program, strnlen(program, header->maxCacheSize));
+		}
+	}
+
+	static void WriteAt(std::ofstream& file, uint_fast64_t offset, const void* source, uint_fast64_t size)
+	{
+		file.seekp(offset);
+		file.write(static_cast<const char*>(source), size);
+	}
+
+	void UseBuffers()
+	{
+		buffersBalanced.Use(columnsBalanced);
+		buffersUnbalanced.Use(columnsUnbalanced);
+		programsBalanced = programsBalancedBuffer.data();
+		programsUnbalanced = programsUnbalancedBuffer.data();
+	}
+
+	// Indexes every stored effect; entries are encoded by EntryKey
+	EffectSet dataSet;
 	
 	uint8_t currentData[data_size];
 	int_fast32_t currentDataIdx;
@@ -67,25 +572,56 @@ private:
 	char currentProgram[max_cache_size];
 	uint_fast32_t currentProgramSize;
 	
+	static inline uint32_t EntryKey(bool balanced, uint_fast32_t index)
+	{
+		return balanced ? index : index | 0x80000000u;
+	}
+
+	// Bytes outside an entry's window are always zero, so comparing the window and the zeros around it is exact
+	inline bool EntryEqual(uint32_t key, int_fast32_t idx, const uint8_t* data) const
+	{
+		bool balanced = (key & 0x80000000u) == 0;
+		const ColumnBuffers& buffers = balanced ? buffersBalanced : buffersUnbalanced;
+		uint_fast32_t index = key & 0x7fffffffu;
+		if (buffers.idx[index] != idx)
+			return false;
+
+		bool empty = buffers.end[index] <= buffers.start[index];
+		int_fast32_t start = empty ? 0 : buffers.start[index] + data_size / 2;
+		int_fast32_t end = empty ? 0 : buffers.end[index] + data_size / 2;
+		for (int_fast32_t i = 0; i < start; i++)
+			if (data[i] != 0)
+				return false;
+		for (int_fast32_t i = end; i < static_cast<int_fast32_t>(data_size); i++)
+			if (data[i] != 0)
+				return false;
+		return memcmp(buffers.windows.data() + buffers.offset[index], data + start, end - start) == 0;
+	}
+
 	void AddData()
 	{
-		auto lookup = LookupData<data_size>(currentDataIdx, currentData);
-		if (dataSet.count(lookup) > 0)
+		bool balanced = currentDataIdx == 0;
+		uint32_t key = EntryKey(balanced, balanced ? dataBalancedCount : dataUnbalancedCount);
+		uint32_t found = dataSet.FindOrInsert(
+			EffectHash<data_size>(currentDataIdx, currentData), key,
+			[&](uint32_t other) { return EntryEqual(other, currentDataIdx, currentData); });
+		if (found != key)
 			return;
-		dataSet.insert(lookup);
 
-		bool balanced = currentDataIdx == 0;
-		std::vector<AlignedData<data_size>>& data = balanced ? dataBalanced : dataUnbalanced;
-		std::vector<char>& programs = balanced ? programsBalanced : programsUnbalanced;
+		ColumnBuffers& buffers = balanced ? buffersBalanced : buffersUnbalanced;
+		std::vector<char>& programs = balanced ? programsBalancedBuffer : programsUnbalancedBuffer;
 		uint_fast32_t& dataCount = balanced ? dataBalancedCount : dataUnbalancedCount;
 
-		data.resize(dataCount + 1);
 		programs.resize((dataCount + 1) * max_cache_size + 1);
 		
-		memcpy(&data[dataCount].data, currentData, data_size);
-		data[dataCount].idx = currentDataIdx;
-		data[dataCount].start = currentDataStart;
-		data[dataCount].end = currentDataEnd;
+		buffers.offset.push_back(buffers.windows.size());
+		buffers.idx.push_back(currentDataIdx);
+		buffers.start.push_back(currentDataStart);
+		buffers.end.push_back(currentDataEnd);
+		if (currentDataEnd > currentDataStart)
+		{
+			buffers.windows.insert(buffers.windows.end(), currentData + currentDataStart + data_size / 2, currentData + currentDataEnd + data_size / 2);
+		}
 		
 		memcpy(&programs[dataCount * max_cache_size], currentProgram, currentProgramSize);
 		programs[dataCount * max_cache_size + currentProgramSize] = '\0';
@@ -93,49 +629,36 @@ private:
 		dataCount++;
 	}
 
-	void AddComposite(
-		AlignedData<data_size>* leftData, AlignedData<data_size>* rightData, 
-		char * leftProgram, char * rightProgram, 
-		unsigned leftProgramSize, unsigned rightProgramSize)
+	// Composes right after left into result; returns false if the composite leaves the data window
+	bool ComposeData(const AlignedData<data_size>& leftData, const AlignedData<data_size>& rightData, AlignedData<data_size>& result) const
 	{
-		//char leftDataIndex = leftData[0] - startDataIndex;
-		//char rightDataIndex = rightData[0] - startDataIndex;
-
-		currentDataIdx = leftData->idx + rightData->idx;
-		if (currentDataIdx < lowDataIdx || currentDataIdx >= highDataIdx)
-			return;
+		int_fast32_t idx = leftData.idx + rightData.idx;
+		if (idx < lowDataIdx || idx >= highDataIdx)
+			return false;
+		result.idx = idx;
 
-		if (leftData->idx > 0)
+		if (leftData.idx > 0)
 		{
-			for (uint8_t rightI = data_size - leftData->idx; rightI < data_size; rightI++)
-				if (rightData->data[rightI] != 0)
-					return;
-			memcpy(currentData, leftData->data, data_size);
-			for (uint8_t rightI = 0; rightI < data_size - leftData->idx; rightI++)
-				currentData[rightI + leftData->idx] += rightData->data[rightI];
+			for (uint8_t rightI = data_size - leftData.idx; rightI < data_size; rightI++)
+				if (rightData.data[rightI] != 0)
+					return false;
+			memcpy(result.data, leftData.data, data_size);
+			for (uint8_t rightI = 0; rightI < data_size - leftData.idx; rightI++)
+				result.data[rightI + leftData.idx] += rightData.data[rightI];
 		}
 		else
 		{
-			for (uint8_t i = 0; i < -leftData->idx; i++)
-				if (rightData->data[i] != 0)
-					return;
-			memcpy(currentData, leftData->data, data_size);
-			for (uint8_t rightI = -leftData->idx; rightI < data_size; rightI++)
-				currentData[rightI + leftData->idx] += rightData->data[rightI];
+			for (uint8_t i = 0; i < -leftData.idx; i++)
+				if (rightData.data[i] != 0)
+					return false;
+			memcpy(result.data, leftData.data, data_size);
+			for (uint8_t rightI = -leftData.idx; rightI < data_size; rightI++)
+				result.data[rightI + leftData.idx] += rightData.data[rightI];
 		}
 
-		memcpy(currentProgram, leftProgram, leftProgramSize);
-		memcpy(currentProgram + leftProgramSize, rightProgram, rightProgramSize);
-		
-		currentDataStart = Min(leftData->start, rightData->start + leftData->idx);
-		currentDataEnd = Max(leftData->end, rightData->end + leftData->idx);
-
-		if (currentDataStart > 10000 || currentDataEnd > 10000)
-		{
-			volatile int x = 0;
-		}
-
-		AddData();
+		result.start = Min<int_fast32_t>(leftData.start, rightData.start + leftData.idx);
+		result.end = Max<int_fast32_t>(leftData.end, rightData.end + leftData.idx);
+		return true;
 	}
 
 	void CreateZero()
@@ -175,25 +698,112 @@ private:
 		currentDataStart = data_size / 2;
 		currentDataEnd = -static_cast<int>(data_size) / 2;
 		
-		currentProgram[0] = '>';
-		currentDataIdx = 1;
-		AddData();
-
 		currentProgram[0] = '<';
 		currentDataIdx = -1;
 		AddData();
 
+		currentProgram[0] = '>';
+		currentDataIdx = 1;
+		AddData();
+
 		bordersBalanced[2] = dataBalancedCount;
 		bordersUnbalanced[2] = dataUnbalancedCount;
 	}
 
+	// One (leftSize, leftType, rightType) product of CreateSize; sequenceStart is the position of its first pair in the serial enumeration order
+	struct CompositeBlock
+	{
+		uint_fast32_t leftSize;
+		bool leftBalanced;
+		bool rightBalanced;
+		uint_fast32_t leftBegin, leftEnd;
+		uint_fast32_t rightBegin, rightEnd;
+		uint_fast64_t sequenceStart;
+	};
+
+	struct CompositeCandidate
+	{
+		uint_fast64_t sequence;
+		uint_fast32_t block;
+		uint_fast32_t leftIndex;
+		uint_fast32_t rightIndex;
+	};
+
+	// Candidates are keyed by entry index into their own vector; a key is compared by recomposing its pair
+	struct CompositeShard
+	{
+		std::mutex lock;
+		EffectSet set;
+		std::vector<CompositeCandidate> candidates;
+	};
+
+	// Smaller sizes expanded back to full windows for the duration of one CreateSize
+	std::vector<AlignedData<data_size>> denseBalanced;
+	std::vector<AlignedData<data_size>> denseUnbalanced;
+
+	inline const AlignedData<data_size>& Entry(bool balanced, uint_fast32_t index) const
+	{
+		return balanced ? denseBalanced[index] : denseUnbalanced[index];
+	}
+
+	inline const char* EntryProgram(bool balanced, uint_fast32_t index) const
+	{
+		return (balanced ? programsBalancedBuffer.data() : programsUnbalancedBuffer.data()) + index * max_cache_size;
+	}
+
+	// Sort key of an entry within its size bucket: idx sign, then centre cell value, then start and end
+	static inline uint64_t AttributeKey(const AlignedData<data_size>& data)
+	{
+		uint64_t sign = data.idx < 0 ? 0 : 1;
+		uint64_t centre = data.data[data_size / 2];
+		uint64_t start = static_cast<uint8_t>(data.start + 128);
+		uint64_t end = static_cast<uint8_t>(data.end + 128);
+		return sign << 24 | centre << 16 | start << 8 | end;
+	}
+
+	void CreateCentreBorders()
+	{
+		for (uint_fast32_t size = 0; size <= max_cache_size; size++)
+		{
+			uint_fast32_t index = bordersBalanced[size];
+			for (uint_fast32_t centre = 0; centre < 257; centre++)
+			{
+				while (index < bordersBalanced[size + 1] && Centre(true, index) < centre)
+					index++;
+				centreBordersBalanced[size][centre] = index;
+			}
+
+			index = bordersUnbalanced[size];
+			for (uint_fast32_t centre = 0; centre < 257; centre++)
+			{
+				while (index < bordersUnbalanced[size + 1] && columnsUnbalanced.idx[index] < 0 && Centre(false, index) < centre)
+					index++;
+				centreBordersNegative[size][centre] = index;
+			}
+			for (uint_fast32_t centre = 0; centre < 257; centre++)
+			{
+				while (index < bordersUnbalanced[size + 1] && Centre(false, index) < centre)
+					index++;
+				centreBordersPositive[size][centre] = index;
+			}
+		}
+	}
+
 	void CreateSize(uint_fast32_t size)
 	{
 		currentProgramSize = size;
 
-		// NOTE: might be more efficient to manually call AddComposite 4 times for balanced/unbalanced pairs
-		//	   likely doesn't make a difference but I am not sure
+		UseBuffers();
+		denseBalanced.resize(dataBalancedCount);
+		denseUnbalanced.resize(dataUnbalancedCount);
+		for (uint_fast32_t e = 0; e < dataBalancedCount; e++)
+			GetData(true, e, denseBalanced[e]);
+		for (uint_fast32_t e = 0; e < dataUnbalancedCount; e++)
+			GetData(false, e, denseUnbalanced[e]);
 
+		// Every pair product in the order a serial build would visit them; the first occurrence of each effect wins
+		std::vector<CompositeBlock> blocks;
+		uint_fast64_t sequenceCount = 0;
 		for (uint_fast32_t leftSize = 1; leftSize < size; leftSize++)
 		{
 			for (int leftType = 0; leftType <= 1; leftType++)
@@ -202,31 +812,130 @@ private:
 				{
 					uint_fast32_t * bordersLeft = leftType == 0 ? bordersBalanced : bordersUnbalanced;
 					uint_fast32_t * bordersRight = rightType == 0 ? bordersBalanced : bordersUnbalanced;
-					std::vector<AlignedData<data_size>> dataLeft = leftType == 0 ? dataBalanced : dataUnbalanced;
-					std::vector<AlignedData<data_size>> dataRight = rightType == 0 ? dataBalanced : dataUnbalanced;
-					std::vector<char> programsLeft = leftType == 0 ? programsBalanced : programsUnbalanced;
-					std::vector<char> programsRight = rightType == 0 ? programsBalanced : programsUnbalanced;
 
-					for (uint_fast32_t leftIndex = bordersLeft[leftSize]; leftIndex < bordersLeft[leftSize + 1]; leftIndex++)
+					CompositeBlock block;
+					block.leftSize = leftSize;
+					block.leftBalanced = leftType == 0;
+					block.rightBalanced = rightType == 0;
+					block.leftBegin = bordersLeft[leftSize];
+					block.leftEnd = bordersLeft[leftSize + 1];
+					block.rightBegin = bordersRight[size - leftSize];
+					block.rightEnd = bordersRight[size - leftSize + 1];
+					block.sequenceStart = sequenceCount;
+					sequenceCount += static_cast<uint_fast64_t>(block.leftEnd - block.leftBegin) * (block.rightEnd - block.rightBegin);
+					blocks.push_back(block);
+				}
+			}
+		}
+
+		// Work is handed out one left entry (against its whole right bucket) at a time
+		std::vector<std::pair<uint_fast32_t, uint_fast32_t>> rows;
+		for (uint_fast32_t b = 0; b < blocks.size(); b++)
+		{
+			if (blocks[b].rightBegin == blocks[b].rightEnd) continue;
+			for (uint_fast32_t leftIndex = blocks[b].leftBegin; leftIndex < blocks[b].leftEnd; leftIndex++)
+				rows.emplace_back(b, leftIndex);
+		}
+
+		CompositeShard shards[CACHE_SHARD_COUNT];
+		std::atomic<uint_fast64_t> nextRow(0);
+
+		auto worker = [&]()
+		{
+			AlignedData<data_size> composite;
+			AlignedData<data_size> otherComposite;
+			uint_fast64_t row;
+			while ((row = nextRow.fetch_add(1, std::memory_order_relaxed)) < rows.size())
+			{
+				const CompositeBlock& block = blocks[rows[row].first];
+				uint_fast32_t leftIndex = rows[row].second;
+				const AlignedData<data_size>& leftData = Entry(block.leftBalanced, leftIndex);
+
+				for (uint_fast32_t rightIndex = block.rightBegin; rightIndex < block.rightEnd; rightIndex++)
+				{
+					if (!ComposeData(leftData, Entry(block.rightBalanced, rightIndex), composite))
+						continue;
+
+					// dataSet only holds smaller sizes here and is not written until every worker has joined
+					uint64_t hash = EffectHash<data_size>(composite.idx, composite.data);
+					if (dataSet.Find(hash, [&](uint32_t other) { return EntryEqual(other, composite.idx, composite.data); }) != EffectSet::npos)
+						continue;
+
+					CompositeCandidate candidate;
+					candidate.sequence = block.sequenceStart
+						+ static_cast<uint_fast64_t>(leftIndex - block.leftBegin) * (block.rightEnd - block.rightBegin)
+						+ (rightIndex - block.rightBegin);
+					candidate.block = rows[row].first;
+					candidate.leftIndex = leftIndex;
+					candidate.rightIndex = rightIndex;
+
+					CompositeShard& shard = shards[(hash >> 40) % CACHE_SHARD_COUNT];
+					std::lock_guard<std::mutex> guard(shard.lock);
+					uint32_t key = shard.candidates.size();
+					uint32_t found = shard.set.FindOrInsert(hash, key, [&](uint32_t other)
 					{
-						for (uint_fast32_t rightIndex = bordersRight[size - leftSize]; rightIndex < bordersRight[size - leftSize + 1]; rightIndex++)
-						{
-							AddComposite(
-								dataLeft.data() + leftIndex,
-								dataRight.data() + rightIndex,
-								programsLeft.data() + (leftIndex * max_cache_size),
-								programsRight.data() + (rightIndex * max_cache_size),
-								leftSize,
-								size - leftSize
-							);
-						}
-					}
+						const CompositeCandidate& otherCandidate = shard.candidates[other];
+						const CompositeBlock& otherBlock = blocks[otherCandidate.block];
+						ComposeData(Entry(otherBlock.leftBalanced, otherCandidate.leftIndex), Entry(otherBlock.rightBalanced, otherCandidate.rightIndex), otherComposite);
+						return otherComposite.idx == composite.idx && memcmp(otherComposite.data, composite.data, data_size) == 0;
+					});
+					if (found == key)
+						shard.candidates.push_back(candidate);
+					else if (candidate.sequence < shard.candidates[found].sequence)
+						shard.candidates[found] = candidate;
 				}
 			}
+		};
+
+		uint_fast32_t threadCount = Max<uint_fast32_t>(1, std::thread::hardware_concurrency());
+		std::vector<std::thread> threads;
+		for (uint_fast32_t i = 1; i < threadCount; i++)
+			threads.emplace_back(worker);
+		worker();
+		for (auto& thread : threads)
+			thread.join();
+
+		std::vector<CompositeCandidate> candidates;
+		for (auto& shard : shards)
+		{
+			candidates.insert(candidates.end(), shard.candidates.begin(), shard.candidates.end());
+			shard.candidates = std::vector<CompositeCandidate>();
+			shard.set.Clear();
+		}
+		std::sort(candidates.begin(), candidates.end(),
+			[](const CompositeCandidate& a, const CompositeCandidate& b) { return a.sequence < b.sequence; });
+
+		// The serial order only decides which pair represents each effect; the bucket itself is stored in attribute order
+		std::vector<std::pair<uint64_t, uint_fast32_t>> order(candidates.size());
+		AlignedData<data_size> composite;
+		for (uint_fast32_t c = 0; c < candidates.size(); c++)
+		{
+			const CompositeBlock& block = blocks[candidates[c].block];
+			ComposeData(Entry(block.leftBalanced, candidates[c].leftIndex), Entry(block.rightBalanced, candidates[c].rightIndex), composite);
+			order[c] = std::make_pair(AttributeKey(composite), c);
+		}
+		std::sort(order.begin(), order.end());
+
+		for (auto& ordered : order)
+		{
+			const CompositeCandidate& candidate = candidates[ordered.second];
+			const CompositeBlock& block = blocks[candidate.block];
+			ComposeData(Entry(block.leftBalanced, candidate.leftIndex), Entry(block.rightBalanced, candidate.rightIndex), composite);
+
+			memcpy(currentData, composite.data, data_size);
+			currentDataIdx = composite.idx;
+			currentDataStart = composite.start;
+			currentDataEnd = composite.end;
+			memcpy(currentProgram, EntryProgram(block.leftBalanced, candidate.leftIndex), block.leftSize);
+			memcpy(currentProgram + block.leftSize, EntryProgram(block.rightBalanced, candidate.rightIndex), size - block.leftSize);
+			AddData();
 		}
 
 		bordersBalanced[size + 1] = dataBalancedCount;
 		bordersUnbalanced[size + 1] = dataUnbalancedCount;
+
+		denseBalanced = std::vector<AlignedData<data_size>>();
+		denseUnbalanced = std::vector<AlignedData<data_size>>();
 	}
 
 public:
@@ -234,20 +943,24 @@ public:
 	{
 		for (uint_fast32_t e = 0; e < dataBalancedCount; e++)
 		{
-			std::cout << programsBalanced.data() + (e * max_cache_size) << std::endl;
+			AlignedData<data_size> entry;
+			GetData(true, e, entry);
+			std::cout << programsBalanced + (e * max_cache_size) << std::endl;
 			for (uint_fast32_t i = 0; i < data_size; i++)
-				std::cout << std::setw(4) << (int)dataBalanced[e].data[i];
-			std::cout << std::endl << std::string((dataBalanced[e].idx + data_size / 2) * 4, ' ') << "  ^" << std::endl;
-			std::cout << dataBalanced[e].start << " " << dataBalanced[e].end;
+				std::cout << std::setw(4) << (int)entry.data[i];
+			std::cout << std::endl << std::string((entry.idx + data_size / 2) * 4, ' ') << "  ^" << std::endl;
+			std::cout << (int)entry.start << " " << (int)entry.end;
 			std::cin.ignore();
 		}
 		for (uint_fast32_t e = 0; e < dataUnbalancedCount; e++)
 		{
-			std::cout << programsUnbalanced.data() + (e * max_cache_size) << std::endl;
+			AlignedData<data_size> entry;
+			GetData(false, e, entry);
+			std::cout << programsUnbalanced + (e * max_cache_size) << std::endl;
 			for (uint_fast32_t i = 0; i < data_size; i++)
-				std::cout << std::setw(4) << (int)dataUnbalanced[e].data[i];
-			std::cout << std::endl << std::string((dataUnbalanced[e].idx + data_size / 2) * 4, ' ') << "  ^" << std::endl;
-			std::cout << dataUnbalanced[e].start << " " << dataUnbalanced[e].end;
+				std::cout << std::setw(4) << (int)entry.data[i];
+			std::cout << std::endl << std::string((entry.idx + data_size / 2) * 4, ' ') << "  ^" << std::endl;
+			std::cout << (int)entry.start << " " << (int)entry.end;
 			std::cin.ignore();
 		}
 	}
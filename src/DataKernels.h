@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+
+#include "AlignedData.h"
+
+// Adds an effect window onto the tape times m, with cell the tape cell the effect's offsets are relative to
+// 32 byte windows take a single masked vector op, in the widest instruction set cpuid reports at startup
+typedef void (*AddWindowKernel)(uint8_t* cell, const uint8_t* window, int_fast32_t start, int_fast32_t end, uint8_t m);
+
+namespace DataKernels
+{
+	inline void AddWindowSSE2(uint8_t* cell, const uint8_t* window, int_fast32_t start, int_fast32_t end, uint8_t m)
+	{
+		const __m128i lowIdx = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+		const __m128i highIdx = _mm_add_epi8(lowIdx, _mm_set1_epi8(16));
+		__m128i first = _mm_set1_epi8(static_cast<char>(start + 16));
+		__m128i last = _mm_set1_epi8(static_cast<char>(end + 15));
+		__m128i factor = _mm_set1_epi16(m);
+		__m128i lowByte = _mm_set1_epi16(0xFF);
+
+		for (int_fast32_t half = 0; half < 2; half++)
+		{
+			__m128i idx = half == 0 ? lowIdx : highIdx;
+			__m128i mask = _mm_andnot_si128(_mm_or_si128(_mm_cmplt_epi8(idx, first), _mm_cmpgt_epi8(idx, last)), _mm_set1_epi8(-1));
+			__m128i effect = _mm_and_si128(_mm_load_si128(reinterpret_cast<const __m128i*>(window + 16 * half)), mask);
+			if (m != 1)
+			{
+				// There is no byte multiply; even and odd bytes are multiplied as words and put back together
+				__m128i even = _mm_and_si128(_mm_mullo_epi16(effect, factor), lowByte);
+				__m128i odd = _mm_slli_epi16(_mm_mullo_epi16(_mm_srli_epi16(effect, 8), factor), 8);
+				effect = _mm_or_si128(even, odd);
+			}
+			__m128i* target = reinterpret_cast<__m128i*>(cell - 16 + 16 * half);
+			_mm_storeu_si128(target, _mm_add_epi8(_mm_loadu_si128(target), effect));
+		}
+	}
+
+	__attribute__((target("avx2")))
+	inline void AddWindowAVX2(uint8_t* cell, const uint8_t* window, int_fast32_t start, int_fast32_t end, uint8_t m)
+	{
+		const __m256i idx = _mm256_setr_epi8(
+			0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+			16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+		__m256i mask = _mm256_andnot_si256(
+			_mm256_or_si256(
+				_mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(start + 16)), idx),
+				_mm256_cmpgt_epi8(idx, _mm256_set1_epi8(static_cast<char>(end + 15)))),
+			_mm256_set1_epi8(-1));
+		__m256i effect = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(window)), mask);
+		if (m != 1)
+		{
+			__m256i factor = _mm256_set1_epi16(m);
+			__m256i even = _mm256_and_si256(_mm256_mullo_epi16(effect, factor), _mm256_set1_epi16(0xFF));
+			__m256i odd = _mm256_slli_epi16(_mm256_mullo_epi16(_mm256_srli_epi16(effect, 8), factor), 8);
+			effect = _mm256_or_si256(even, odd);
+		}
+		__m256i* target = reinterpret_cast<__m256i*>(cell - 16);
+		_mm256_storeu_si256(target, _mm256_add_epi8(_mm256_loadu_si256(target), effect));
+	}
+
+	__attribute__((target("avx512bw,avx512vl")))
+	inline void AddWindowAVX512(uint8_t* cell, const uint8_t* window, int_fast32_t start, int_fast32_t end, uint8_t m)
+	{
+		__mmask32 mask = end <= start ? 0 : static_cast<__mmask32>((static_cast<uint64_t>(1) << (end + 16)) - (static_cast<uint64_t>(1) << (start + 16)));
+		__m256i effect = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(window));
+		if (m != 1)
+		{
+			__m256i factor = _mm256_set1_epi16(m);
+			__m256i even = _mm256_mullo_epi16(effect, factor);
+			__m256i odd = _mm256_slli_epi16(_mm256_mullo_epi16(_mm256_srli_epi16(effect, 8), factor), 8);
+			effect = _mm256_mask_blend_epi8(0xAAAAAAAA, even, odd);
+		}
+		__m256i* target = reinterpret_cast<__m256i*>(cell - 16);
+		__m256i tape = _mm256_loadu_si256(target);
+		_mm256_storeu_si256(target, _mm256_mask_add_epi8(tape, mask, tape, effect));
+	}
+
+	inline AddWindowKernel SelectAddWindow()
+	{
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl"))
+			return AddWindowAVX512;
+		if (__builtin_cpu_supports("avx2"))
+			return AddWindowAVX2;
+		return AddWindowSSE2;
+	}
+
+	inline const AddWindowKernel addWindow = SelectAddWindow();
+}
+
+// Adds effect's window onto the tape around cell. Single steps change a few cells next to the ones the last step changed,
+// where a full width vector store would stall the next step's load, so this stays a loop over the window
+template<uint_fast32_t data_size>
+inline void AddEffect(uint8_t* cell, const AlignedData<data_size>& effect)
+{
+	for (int_fast32_t i = effect.start; i < effect.end; i++)
+	{
+		cell[i] += effect.data[i + data_size / 2];
+	}
+}
+
+// Adds m times effect's window onto the tape around cell; the tape must have data_size / 2 cells of room on both sides of cell
+template<uint_fast32_t data_size>
+inline void AddEffectMult(uint8_t* cell, const AlignedData<data_size>& effect, uint8_t m)
+{
+	if constexpr (data_size == 32)
+	{
+		DataKernels::addWindow(cell, effect.data, effect.start, effect.end, m);
+		return;
+	}
+
+	for (int_fast32_t i = effect.start; i < effect.end; i++)
+	{
+		cell[i] += effect.data[i + data_size / 2] * m;
+	}
+}
+
+// Compares count tape cells from cell with other
+inline bool CellsEqual(const uint8_t* cell, const void* other, uint_fast32_t count)
+{
+	return memcmp(cell, other, count) == 0;
+}
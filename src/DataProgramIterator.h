@@ -3,10 +3,12 @@
 #include <assert.h>
 #include "LinearIterator.h"
 #include "ModDivisionTable.h"
+#include "CycleDetector.h"
 
 // #define SINGLE_BRACKET_HIERARCHY
 // #define MAX_BRACKET_DEPTH 2
 #define MAX_JUMPS 20000
+#define DETECT_CYCLES
 #define SHORT_CIRCUIT_LINEAR_SINGULAR
 // #define INITIAL_ZERO
 // #define INITIAL_DATA_SYMMETRIC
@@ -18,7 +20,9 @@ class DataProgramIterator
 {
 public:
 	DataProgramIterator()
+		: dataBoundLow(0), dataBoundHigh(0)
 	{
+		memset(data, 0, data_size + 2 * cache_data_size);
 	}
 	~DataProgramIterator()
 	{
@@ -30,6 +34,7 @@ public:
 		for (uint_fast32_t i = 0; i < max_program_size; i++)
 		{
 			iterators[i].SetCache(cache);
+			iterators[i].SetCompositeSet(&compositeSet);
 		}
 	}
 
@@ -48,6 +53,8 @@ private:
 	uint_fast64_t currentCount;
 
 	LinearIterator<cache_data_size, cache_size, max_program_size> iterators[max_program_size];
+	// Lets the iterators skip repeated composites of segments too long for the cache's masks
+	CompositeSet compositeSet;
 	uint_fast32_t iteratorCount;
 	
 	int_fast32_t iteratorSizes[max_program_size];
@@ -215,6 +222,7 @@ private:
 
 	bool NextSingleIterator()
 	{
+		SetPrune();
 		while (iterators[iteratorIdx].Next())
 		{
 #if defined INITIAL_ZERO || defined INITIAL_DATA_SYMMETRIC
@@ -263,6 +271,23 @@ private:
 		return false;
 	}
 
+	// Lets the linear iterator skip whole cache blocks which NextSingleIterator would reject one at a time
+	void SetPrune()
+	{
+		auto& iterator = iterators[iteratorIdx];
+		iterator.ClearPrune();
+#if defined INITIAL_ZERO || defined INITIAL_DATA_SYMMETRIC
+		if (iteratorIdx <= firstIteratorWithNonZeroDataDelta)
+			iterator.PruneNegativeDelta();
+#endif
+#ifdef INITIAL_ZERO
+		if (iteratorIdx == 0)
+			iterator.PruneCentre(0);
+#endif
+		if (iteratorSizes[iteratorIdx] == 1 && iteratorIdx > 0 && brackets[iteratorIdx - 1].bracket == Bracket::LEFT && brackets[iteratorIdx].bracket == Bracket::RIGHT)
+			iterator.PruneCentre(255);
+	}
+
 	bool NextBrackets()
 	{
 		if (iteratorCount == 1)
@@ -414,8 +439,10 @@ private:
 private:
 	uint8_t data[data_size + 2 * cache_data_size];
 	uint_fast32_t dataIdx;
+	// Cells outside [dataBoundLow, dataBoundHigh) are zero; only this range is reset between executions
 	uint_fast32_t dataBoundLow;
 	uint_fast32_t dataBoundHigh;
+	CycleDetector<data_size + 2 * cache_data_size> cycles;
 	
 	ModDivisionTable* divisionTable;
 
@@ -432,13 +459,15 @@ public:
 
 		uint_fast32_t programIdx = 0;
 		dataIdx = data_size / 2 + cache_data_size;
-		//dataBoundLow = dataIdx;
-		//dataBoundHigh = dataIdx + 1;
-		
-		memset(data, 0, data_size + 2 * cache_data_size);
+
+		ClearData();
 		memcpy(data + dataIdx + initialDataOffset, initialData, initialDataSize);
+		TouchData(dataIdx + initialDataOffset, dataIdx + initialDataOffset + initialDataSize);
 
 		uint_fast32_t remainingJumps = MAX_JUMPS;
+#ifdef DETECT_CYCLES
+		cycles.Reset();
+#endif
 		while (remainingJumps--)
 		{
 			if (programIdx >= iteratorCount)
@@ -446,8 +475,14 @@ public:
 				lastExecutionSuccessful = true;
 				return true;
 			}
+#ifdef DETECT_CYCLES
+			if (cycles.Cycled(programIdx, dataIdx, 0, data, dataBoundLow, dataBoundHigh))
+			{
+				return false;
+			}
+#endif
 
-			auto iteratorData = iterators[programIdx].Data();
+			auto& iteratorData = iterators[programIdx].Data();
 			// is of the form '[*]' where * is only <>+-
 			bool isLinear = jumps[programIdx].nonzero == programIdx;
 
@@ -509,20 +544,12 @@ public:
 
 	inline bool DataEqual(const uint8_t* otherData, uint_fast32_t count, int_fast32_t offset)
 	{
-		for (uint_fast32_t i = 0; i < count; i++)
-		{
-			if (data[i + dataIdx + offset] != otherData[i]) return false;
-		}
-		return true;
+		return CellsEqual(data + dataIdx + offset, otherData, count);
 	}
 
 	inline bool DataEqual(const char* otherData, uint_fast32_t count, int_fast32_t offset)
 	{
-		for (uint_fast32_t i = 0; i < count; i++)
-		{
-			if (data[i + dataIdx + offset] != static_cast<uint8_t>(otherData[i])) return false;
-		}
-		return true;
+		return CellsEqual(data + dataIdx + offset, otherData, count);
 	}
 
 	inline bool DataEqualZeroOrNonzero(const uint8_t* otherData, uint_fast32_t count, int_fast32_t offset)
@@ -576,24 +603,32 @@ public:
 private:
 	inline void ApplyData(AlignedData<cache_data_size>& argData)
 	{
-		//uint_fast32_t sseLow = argData.start / 16;
-		//uint_fast32_t sseHigh = argData.end / 16;
-		//
-		//__m128i sseArgData = reinterpret_cast<__m128i*> argData.data;
-		//__m123i sseData = reinterpret_cast<__m128i*> data + dataIdx;
-
-		for (int_fast32_t i = argData.start; i < argData.end; i++)
-		{
-			data[dataIdx + i] += argData.data[i + cache_data_size / 2];
-		}
+		AddEffect(data + dataIdx, argData);
+		TouchData(dataIdx + argData.start, dataIdx + argData.end);
 	}
 
 	inline void ApplyDataMult(AlignedData<cache_data_size>& argData, uint8_t m)
 	{
-		for (int_fast32_t i = argData.start; i < argData.end; i++)
+		AddEffectMult(data + dataIdx, argData, m);
+		TouchData(dataIdx + argData.start, dataIdx + argData.end);
+	}
+
+	inline void TouchData(uint_fast32_t low, uint_fast32_t high)
+	{
+		if (low >= high) return;
+		dataBoundLow = Min(dataBoundLow, low);
+		dataBoundHigh = Max(dataBoundHigh, high);
+	}
+
+	// Zeroes the cells the last execution may have changed
+	inline void ClearData()
+	{
+		if (dataBoundLow < dataBoundHigh)
 		{
-			data[dataIdx + i] += argData.data[i + cache_data_size / 2] * m;
+			memset(data + dataBoundLow, 0, dataBoundHigh - dataBoundLow);
 		}
+		dataBoundLow = data_size + 2 * cache_data_size;
+		dataBoundHigh = 0;
 	}
 
 public:
@@ -622,8 +657,10 @@ public:
 
 	void PrintData()
 	{
-		for (uint_fast32_t i = dataBoundLow; i <= dataBoundHigh; i++)
+		uint_fast32_t low = Min(dataBoundLow, dataIdx);
+		uint_fast32_t high = Max(dataBoundHigh, dataIdx + 1);
+		for (uint_fast32_t i = low; i < high; i++)
 			std::cout << std::setw(4) << (int)data[i];
-		std::cout << std::endl << std::string((dataIdx - dataBoundLow) * 4, ' ') << "  ^" << std::endl;
+		std::cout << std::endl << std::string((dataIdx - low) * 4, ' ') << "  ^" << std::endl;
 	}
 };
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Hashes an effect (final data index plus the full data window) 8 bytes at a time with a 128 bit multiply fold per word
+template<uint_fast32_t data_size>
+uint64_t EffectHash(int_fast32_t idx, const uint8_t* data)
+{
+	static const uint64_t secret[4] = {
+		0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+	};
+
+	uint64_t acc = 0x1d8e4e27c47d124full ^ static_cast<uint64_t>(static_cast<int64_t>(idx));
+	uint_fast32_t i = 0;
+	for (; i + 8 <= data_size; i += 8)
+	{
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		unsigned __int128 product = static_cast<unsigned __int128>(word ^ secret[(i / 8) % 4]) * (acc ^ secret[(i / 8 + 1) % 4]);
+		acc = static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+	}
+	if (i < data_size)
+	{
+		uint64_t word = 0;
+		memcpy(&word, data + i, data_size - i);
+		unsigned __int128 product = static_cast<unsigned __int128>(word ^ secret[0]) * (acc ^ secret[1]);
+		acc = static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+	}
+
+	// Final avalanche so both the slot bits and the fingerprint bits are well mixed
+	acc ^= acc >> 33;
+	acc *= 0xff51afd7ed558ccdull;
+	acc ^= acc >> 33;
+	acc *= 0xc4ceb9fe1a85ec53ull;
+	acc ^= acc >> 33;
+	return acc;
+}
+
+// Open addressing set of entry indices keyed by effect hash; the effects themselves stay in the caller's arrays,
+// so each slot only holds the 64 bit fingerprint and a 32 bit entry index
+class EffectSet
+{
+public:
+	static const uint32_t npos = 0xffffffffu;
+
+	EffectSet()
+		: count(0), mask(0)
+	{
+	}
+
+	inline uint_fast64_t Count() const
+	{
+		return count;
+	}
+
+	inline uint_fast64_t MemorySize() const
+	{
+		return slots.size() * sizeof(Slot);
+	}
+
+	void Clear()
+	{
+		slots.clear();
+		slots.shrink_to_fit();
+		count = 0;
+		mask = 0;
+	}
+
+	void Reserve(uint_fast64_t entries)
+	{
+		uint_fast64_t capacity = 16;
+		while (capacity * 7 < entries * 10)
+			capacity *= 2;
+		if (capacity > slots.size())
+			Rehash(capacity);
+	}
+
+	// equal(entry) must compare the stored entry against the effect being looked up
+	template<typename EqualT>
+	uint32_t Find(uint64_t hash, EqualT equal) const
+	{
+		if (count == 0)
+			return npos;
+		for (uint_fast64_t pos = hash & mask; ; pos = (pos + 1) & mask)
+		{
+			const Slot& slot = slots[pos];
+			if (slot.entry == npos)
+				return npos;
+			if (slot.fingerprint == hash && equal(slot.entry))
+				return slot.entry;
+		}
+	}
+
+	// Returns the already stored equal entry, or entry itself if it was inserted
+	template<typename EqualT>
+	uint32_t FindOrInsert(uint64_t hash, uint32_t entry, EqualT equal)
+	{
+		if ((count + 1) * 10 > slots.size() * 7)
+			Rehash(slots.empty() ? 16 : slots.size() * 2);
+
+		for (uint_fast64_t pos = hash & mask; ; pos = (pos + 1) & mask)
+		{
+			Slot& slot = slots[pos];
+			if (slot.entry == npos)
+			{
+				slot.fingerprint = hash;
+				slot.entry = entry;
+				count++;
+				return entry;
+			}
+			if (slot.fingerprint == hash && equal(slot.entry))
+				return slot.entry;
+		}
+	}
+
+private:
+	struct Slot
+	{
+		uint64_t fingerprint;
+		uint32_t entry;
+	};
+
+	std::vector<Slot> slots;
+	uint_fast64_t count;
+	uint_fast64_t mask;
+
+	// Growing only needs the stored fingerprints, never the effects
+	void Rehash(uint_fast64_t capacity)
+	{
+		std::vector<Slot> oldSlots(capacity, Slot{ 0, npos });
+		oldSlots.swap(slots);
+		mask = capacity - 1;
+
+		for (const Slot& oldSlot : oldSlots)
+		{
+			if (oldSlot.entry == npos)
+				continue;
+			uint_fast64_t pos = oldSlot.fingerprint & mask;
+			while (slots[pos].entry != npos)
+				pos = (pos + 1) & mask;
+			slots[pos] = oldSlot;
+		}
+	}
+};
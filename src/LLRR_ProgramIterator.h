@@ -32,6 +32,7 @@ public:
 		for (uint_fast32_t i = 0; i < 4; i++)
 		{
 			iterators[i].SetCache(cache);
+			iterators[i].SetCompositeSet(&compositeSet);
 		}
 	}
 
@@ -46,6 +47,8 @@ private:
 	uint_fast32_t threadDelta;
 
 	LinearIterator<cache_data_size, cache_size, max_program_size> iterators[4];
+	// Lets the iterators skip repeated composites of segments too long for the cache's masks
+	CompositeSet compositeSet;
 	int_fast32_t iteratorIdx;
 	int_fast32_t iteratorSizes[4];
 	int_fast32_t remainingSize;
@@ -249,8 +252,8 @@ private:
 		constexpr uint_fast32_t dataZeroIdx = cache_data_size / 2;
 
 		int_fast32_t k = dataLeft.idx;
-		uint_fast32_t startIdx = Min(dataLeft.start, Min(dataInner.start + k, dataRight.start + k));
-		uint_fast32_t endIdx = Max(dataLeft.end, Max(dataInner.end + k, dataRight.end + k));
+		uint_fast32_t startIdx = Min<int_fast32_t>(dataLeft.start, Min(dataInner.start + k, dataRight.start + k));
+		uint_fast32_t endIdx = Max<int_fast32_t>(dataLeft.end, Max(dataInner.end + k, dataRight.end + k));
 
 #ifdef NO_LEFT_DATA
 		if (startIdx + dataIdx < data_size / 2 + cache_data_size) return false;
@@ -304,8 +307,8 @@ private:
 		constexpr uint_fast32_t dataZeroIdx = cache_data_size / 2;
 
 		int_fast32_t k = dataLeft.idx;
-		uint_fast32_t startIdx = Min(dataLeft.start, Min(dataInner.start + k, dataRight.start + k));
-		uint_fast32_t endIdx = Max(dataLeft.end, Max(dataInner.end + k, dataRight.end + k));
+		uint_fast32_t startIdx = Min<int_fast32_t>(dataLeft.start, Min(dataInner.start + k, dataRight.start + k));
+		uint_fast32_t endIdx = Max<int_fast32_t>(dataLeft.end, Max(dataInner.end + k, dataRight.end + k));
 
 		// Directly simulate, will either reach data boundary or complete
 		while (data[dataIdx] != 0)
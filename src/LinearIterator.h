@@ -4,14 +4,24 @@
 #include <fstream>
 
 #include "DataCache.h"
+#include "EffectSet.h"
 #include "Util.h"
 
+// Positions of the composites one LinearIterator has walked since its Start
+// The iterators of a program iterator share one, so each thread holds a single set; another iterator using it clears it first
+struct CompositeSet
+{
+	const void* owner = nullptr;
+	EffectSet set;
+	std::vector<uint_fast64_t> positions;
+};
+
 template<uint_fast32_t data_size, uint_fast32_t cache_size, uint_fast32_t max_program_size = 32>
 class LinearIterator
 {
 public:
 	LinearIterator()
-		: cache(nullptr)
+		: cache(nullptr), pruneNegativeDelta(false), prunedCentreCount(0), compositeMask(nullptr), compositeSet(nullptr)
 	{
 	}
 	~LinearIterator()
@@ -28,15 +38,42 @@ private:
 	uint_fast32_t indexStack[max_stack_size];
 	bool balancedStack[max_stack_size];
 	AlignedData<data_size> dataStack[max_stack_size];
+	// Whether dataStack[i] is the frames' exact effect; composing frames can push part of it out of the data window
+	bool exactStack[max_stack_size];
+	// dataStack[i] is only up to date for i >= validFrame; lower frames are composed once their data is asked for
+	uint_fast32_t validFrame;
 
 	bool first;
 
+	// Composites the caller rejects anyway; whole blocks of the last frame are skipped while they map directly onto the composite
+	static const uint_fast32_t max_pruned_centres = 4;
+	bool pruneNegativeDelta;
+	uint8_t prunedCentres[max_pruned_centres];
+	uint_fast32_t prunedCentreCount;
+
+	// Set for two frame segments; only the first frame pair giving each composite effect is walked
+	const uint64_t* compositeMask;
+	uint_fast64_t compositeMaskStride;
+
+	// Longer segments record the composites walked since Start in compositeSet instead, up to COMPOSITE_SET_MAX_ENTRIES of them
+	CompositeSet* compositeSet;
+	bool compositeSetUsed;
+	// The first composite after Start cannot be a repeat, so it is only recorded once the walk goes on past it
+	bool compositeWalked;
+	bool firstCompositePending;
+	uint_fast64_t firstCompositePosition;
+
 public:
 	inline void SetCache(DataCache<data_size, cache_size>* cache)
 	{
 		this->cache = cache;
 	}
 
+	inline void SetCompositeSet(CompositeSet* compositeSet)
+	{
+		this->compositeSet = compositeSet;
+	}
+
 	void Start(uint_fast32_t programSize)
 	{
 		stackSize = programSize == 0 ? 1 : (programSize - 1) / cache_size + 1;
@@ -50,6 +87,24 @@ public:
 			balancedStack[i] = true;
 		}
 		first = true;
+		SetCompositeMask();
+	}
+
+	// Starts with the frames at Position() == position; the first Next returns it unless it is skipped
+	void StartAt(uint_fast32_t programSize, uint_fast64_t position)
+	{
+		Start(programSize);
+
+		uint_fast64_t firstCount = cache->SizeCount(firstCacheSize);
+		cache->BucketEntry(firstCacheSize, position % firstCount, balancedStack[0], indexStack[0]);
+		position /= firstCount;
+
+		uint_fast64_t cacheSizeCount = cache->SizeCount(cache_size);
+		for (uint_fast32_t i = 1; i < stackSize; i++)
+		{
+			cache->BucketEntry(cache_size, position % cacheSizeCount, balancedStack[i], indexStack[i]);
+			position /= cacheSizeCount;
+		}
 	}
 
 	bool Next()
@@ -57,24 +112,63 @@ public:
 		if (first)
 		{
 			first = false;
-			for (int i = stackSize - 1; i >= 0; i--) CalcData(i);
-			return true;
+			validFrame = stackSize;
+			if (Settle())
+			{
+				return true;
+			}
+			return IncPrefix();
 		}
 		return Inc();
 	}
 
+	inline void ClearPrune()
+	{
+		pruneNegativeDelta = false;
+		prunedCentreCount = 0;
+	}
+
+	// Skip composites which move the data pointer left
+	inline void PruneNegativeDelta()
+	{
+		pruneNegativeDelta = true;
+	}
+
+	// Skip composites which leave the starting cell with this value
+	inline void PruneCentre(uint8_t value)
+	{
+		assert(prunedCentreCount < max_pruned_centres);
+		prunedCentres[prunedCentreCount++] = value;
+	}
+
+	// Moves the first frame to the last entry of its centre block if that block decides the composite's centre; Next then continues after the block
+	void SkipCentre()
+	{
+		// While every frame is balanced the first frame adds its centre straight onto the composite's
+		for (uint_fast32_t i = 0; i < stackSize; i++)
+			if (!balancedStack[i])
+				return;
+
+		uint8_t centre = cache->Centre(true, indexStack[0]);
+		indexStack[0] = cache->CentreBorders(true, false, firstCacheSize)[centre + 1] - 1;
+		Invalidate(0);
+	}
+
 	inline AlignedData<data_size>& Data()
 	{
+		Materialize(0);
 		return dataStack[0];
 	}
 	
-	inline bool IsBalanced() const
+	inline bool IsBalanced()
 	{
+		Materialize(0);
 		return dataStack[0].idx == 0;
 	}
 
-	inline int_fast32_t DataDelta() const
+	inline int_fast32_t DataDelta()
 	{
+		Materialize(0);
 		return dataStack[0].idx;
 	}
 
@@ -92,6 +186,18 @@ public:
 		return result;
 	}
 
+	// Index of the current frames among all SizeCount(programSize) combinations, in the order Next walks them; the first frame varies fastest
+	uint_fast64_t Position()
+	{
+		uint_fast64_t cacheSizeCount = cache->SizeCount(cache_size);
+		uint_fast64_t position = 0;
+		for (uint_fast32_t i = stackSize - 1; i > 0; i--)
+		{
+			position = position * cacheSizeCount + cache->BucketPosition(balancedStack[i], indexStack[i], cache_size);
+		}
+		return position * cache->SizeCount(firstCacheSize) + cache->BucketPosition(balancedStack[0], indexStack[0], firstCacheSize);
+	}
+
 	void Serialize(std::ostream& output)
 	{
 		output << stackSize << " " << firstCacheSize << " ";
@@ -119,9 +225,10 @@ public:
 			input >> balancedStack[i];
 		}
 		input >> first;
+		SetCompositeMask();
 
-		// Restore dataStack
-		for (int i = stackSize - 1; i >= 0; i--) CalcData(i);
+		// dataStack is restored when it is next needed
+		validFrame = stackSize;
 
 		return true;
 	}
@@ -129,19 +236,213 @@ public:
 private:
 	bool Inc()
 	{
-		if (IncSingle(indexStack[0], balancedStack[0], firstCacheSize))
+		if (IncSingle(indexStack[0], balancedStack[0], firstCacheSize) && Settle())
 		{
-			CalcData(0);
+			Invalidate(0);
 			return true;
 		}
+		return IncPrefix();
+	}
+
+	// Advances the frames after the first, until the first frame has an entry left for the new prefix
+	bool IncPrefix()
+	{
 		for (uint_fast32_t i = 1; i < stackSize; i++)
 		{
 			if (IncSingle(indexStack[i], balancedStack[i], cache_size))
 			{
-				for (int j = i; j >= 0; j--) CalcData(j);
+				Invalidate(i);
+				if (Settle())
+				{
+					return true;
+				}
+				i = 0;
+			}
+		}
+		return false;
+	}
+
+	void SetCompositeMask()
+	{
+		compositeMask = stackSize == 2 ? cache->CompositeMask(firstCacheSize) : nullptr;
+		compositeMaskStride = cache->SizeCount(firstCacheSize);
+
+		compositeSetUsed = compositeSet != nullptr && stackSize > 1 && compositeMask == nullptr;
+		compositeWalked = false;
+		firstCompositePending = false;
+		if (compositeSet != nullptr && compositeSet->owner == this)
+			compositeSet->owner = nullptr;
+	}
+
+	// Moves the first frame to the next entry which is neither pruned nor a repeated composite; returns false, with the frame wrapped back to its start, if none are left
+	bool Settle()
+	{
+		while (SkipPruned())
+		{
+			if (compositeMask != nullptr)
+			{
+				uint_fast64_t pair = cache->BucketPosition(balancedStack[1], indexStack[1], cache_size) * compositeMaskStride
+					+ cache->BucketPosition(balancedStack[0], indexStack[0], firstCacheSize);
+				if (compositeMask[pair / 64] & static_cast<uint64_t>(1) << (pair % 64))
+					return true;
+			}
+			else if (!compositeSetUsed || FirstComposite())
+			{
+				return true;
+			}
+			if (!IncSingle(indexStack[0], balancedStack[0], firstCacheSize))
+				return false;
+		}
+		return false;
+	}
+
+	// Returns false if an earlier walked position since Start gave the same composite; composites cut by the data window are always walked
+	// Segments restarted after their first composite, as after most failed executions, are left uncomposed as Data() would leave them
+	bool FirstComposite()
+	{
+		if (!compositeWalked)
+		{
+			compositeWalked = true;
+			firstCompositePending = true;
+			firstCompositePosition = Position();
+			return true;
+		}
+
+		if (compositeSet->owner != this)
+		{
+			compositeSet->owner = this;
+			compositeSet->set.Clear();
+			compositeSet->positions.clear();
+		}
+		if (firstCompositePending)
+		{
+			firstCompositePending = false;
+			AlignedData<data_size> firstComposite;
+			if (Compose(firstCompositePosition, firstComposite))
+				Record(firstComposite, firstCompositePosition);
+		}
+
+		Invalidate(0);
+		Materialize(0);
+		return !exactStack[0] || Record(dataStack[0], Position());
+	}
+
+	// Adds the composite at position to compositeSet while it has room; returns false if it was already there
+	bool Record(const AlignedData<data_size>& composite, uint_fast64_t position)
+	{
+		std::vector<uint_fast64_t>& positions = compositeSet->positions;
+		uint64_t hash = EffectHash<data_size>(composite.idx, composite.data);
+		auto equal = [&](uint32_t other)
+		{
+			AlignedData<data_size> otherComposite;
+			Compose(positions[other], otherComposite);
+			return otherComposite.idx == composite.idx && memcmp(otherComposite.data, composite.data, data_size) == 0;
+		};
+
+		if (positions.size() == COMPOSITE_SET_MAX_ENTRIES)
+			return compositeSet->set.Find(hash, equal) == EffectSet::npos;
+
+		uint32_t entry = positions.size();
+		if (compositeSet->set.FindOrInsert(hash, entry, equal) != entry)
+			return false;
+		positions.push_back(position);
+		return true;
+	}
+
+	// Composes the frames at Position() == position into result; returns whether that is their exact effect
+	bool Compose(uint_fast64_t position, AlignedData<data_size>& result)
+	{
+		uint_fast64_t framePositions[max_stack_size];
+		uint_fast64_t firstCount = cache->SizeCount(firstCacheSize);
+		framePositions[0] = position % firstCount;
+		position /= firstCount;
+
+		uint_fast64_t cacheSizeCount = cache->SizeCount(cache_size);
+		for (uint_fast32_t i = 1; i < stackSize; i++)
+		{
+			framePositions[i] = position % cacheSizeCount;
+			position /= cacheSizeCount;
+		}
+
+		bool balanced;
+		uint_fast32_t index;
+		bool exact = true;
+		AlignedData<data_size> prefix, frame;
+		cache->BucketEntry(cache_size, framePositions[stackSize - 1], balanced, index);
+		cache->GetData(balanced, index, result);
+		for (int_fast32_t i = stackSize - 2; i >= 0 && exact; i--)
+		{
+			cache->BucketEntry(i == 0 ? firstCacheSize : cache_size, framePositions[i], balanced, index);
+			cache->GetData(balanced, index, frame);
+			prefix = result;
+			exact = AddData<data_size>(result, prefix, frame) && ComposesExactly(prefix, frame);
+		}
+		return exact;
+	}
+
+	// Whether adding frame after prefix keeps the whole of frame's window, moved by the prefix's delta, inside the data window
+	static inline bool ComposesExactly(const AlignedData<data_size>& prefix, const AlignedData<data_size>& frame)
+	{
+		return frame.end <= frame.start ||
+			(frame.start + prefix.idx >= -static_cast<int_fast32_t>(data_size) / 2 && frame.end + prefix.idx <= static_cast<int_fast32_t>(data_size - data_size / 2));
+	}
+
+	// Moves the first frame past whole pruned blocks; returns false, with the frame wrapped back to its start, if none are left
+	bool SkipPruned()
+	{
+		if (!pruneNegativeDelta && prunedCentreCount == 0)
+			return true;
+
+		// With a moving prefix the first frame's sign and centre no longer decide the composite's
+		uint8_t prefixCentre = 0;
+		if (stackSize > 1)
+		{
+			Materialize(1);
+			if (dataStack[1].idx != 0)
 				return true;
+			prefixCentre = dataStack[1].data[data_size / 2];
+		}
+
+		uint_fast32_t& index = indexStack[0];
+		bool& balanced = balancedStack[0];
+		while (true)
+		{
+			uint_fast32_t end = balanced ? cache->bordersBalanced[firstCacheSize + 1] : cache->bordersUnbalanced[firstCacheSize + 1];
+			if (index >= end)
+			{
+				if (balanced && firstCacheSize != 0)
+				{
+					index = cache->bordersUnbalanced[firstCacheSize];
+					balanced = false;
+					continue;
+				}
+				index = cache->bordersBalanced[firstCacheSize];
+				balanced = true;
+				return false;
+			}
+
+			bool negative = !balanced && cache->columnsUnbalanced.idx[index] < 0;
+			if (negative && pruneNegativeDelta)
+			{
+				index = cache->centreBordersPositive[firstCacheSize][0];
+				continue;
+			}
+
+			uint8_t centre = cache->Centre(balanced, index);
+			if (IsPrunedCentre(static_cast<uint8_t>(prefixCentre + centre)))
+			{
+				index = cache->CentreBorders(balanced, negative, firstCacheSize)[centre + 1];
+				continue;
 			}
+			return true;
 		}
+	}
+
+	inline bool IsPrunedCentre(uint8_t value) const
+	{
+		for (uint_fast32_t i = 0; i < prunedCentreCount; i++)
+			if (prunedCentres[i] == value)
+				return true;
 		return false;
 	}
 
@@ -165,19 +466,36 @@ private:
 				return false;
 			}
 		}
+		if (index + CACHE_PREFETCH_DISTANCE < end)
+			cache->Prefetch(balanced, index + CACHE_PREFETCH_DISTANCE);
 		return true;
 	}
 
+	// Frames at or below frame changed
+	inline void Invalidate(uint_fast32_t frame)
+	{
+		validFrame = Max<uint_fast32_t>(validFrame, frame + 1);
+	}
+
+	inline void Materialize(uint_fast32_t frame)
+	{
+		while (validFrame > frame)
+			CalcData(--validFrame);
+	}
+
 	void CalcData(uint_fast32_t idx)
 	{
-		AlignedData<data_size>& data = balancedStack[idx] ? cache->dataBalanced[indexStack[idx]] : cache->dataUnbalanced[indexStack[idx]];
 		if (idx == stackSize - 1)
 		{
-			dataStack[idx] = data;
+			cache->GetData(balancedStack[idx], indexStack[idx], dataStack[idx]);
+			exactStack[idx] = true;
 		}
 		else
 		{
-			AddData<data_size>(dataStack[idx], dataStack[idx + 1], data);
+			AlignedData<data_size> data;
+			cache->GetData(balancedStack[idx], indexStack[idx], data);
+			bool composed = AddData<data_size>(dataStack[idx], dataStack[idx + 1], data);
+			exactStack[idx] = composed && exactStack[idx + 1] && ComposesExactly(dataStack[idx + 1], data);
 		}
 	}
 
@@ -193,11 +511,11 @@ public:
 			uint_fast32_t idx = indexStack[i];
 			uint_fast32_t size = i == 0 ? firstCacheSize : cache_size;
 			
-			char* part;
+			const char* part;
 			if (balancedStack[i])
-				part = cache->programsBalanced.data() + (idx * cache_size);
+				part = cache->programsBalanced + (idx * cache_size);
 			else
-				part = cache->programsUnbalanced.data() + (idx * cache_size);
+				part = cache->programsUnbalanced + (idx * cache_size);
 			
 			memcpy(currentProgram + pIndex, part, size * sizeof(char));
 			pIndex += size;
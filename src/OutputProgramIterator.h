@@ -4,10 +4,12 @@
 #include <locale>
 #include "LinearIterator.h"
 #include "ModDivisionTable.h"
+#include "CycleDetector.h"
 
 // #define SINGLE_BRACKET_HIERARCHY
 // #define MAX_BRACKET_DEPTH 1
 #define MAX_JUMPS 25000
+#define DETECT_CYCLES
 #define SHORT_CIRCUIT_LINEAR_SINGULAR
 // #define INITIAL_DATA_SYMMETRIC
 #define NO_TRAILING_LINEAR_PROGRAM
@@ -26,7 +28,9 @@ class OutputProgramIterator
 {
 public:
 	OutputProgramIterator()
+		: dataBoundLow(0), dataBoundHigh(0)
 	{
+		memset(data, 0, data_size + 2 * cache_data_size);
 	}
 	~OutputProgramIterator()
 	{
@@ -38,6 +42,7 @@ public:
 		for (uint_fast32_t i = 0; i < max_program_size; i++)
 		{
 			iterators[i].SetCache(cache);
+			iterators[i].SetCompositeSet(&compositeSet);
 		}
 	}
 
@@ -57,6 +62,8 @@ private:
 	uint_fast64_t currentCount;
 
 	LinearIterator<cache_data_size, cache_size, max_program_size> iterators[max_program_size];
+	// Lets the iterators skip repeated composites of segments too long for the cache's masks
+	CompositeSet compositeSet;
 	uint_fast32_t iteratorCount;
 	
 	int_fast32_t iteratorSizes[max_program_size];
@@ -278,6 +285,7 @@ private:
 
 	bool NextSingleIterator()
 	{
+		SetPrune();
 		while (iterators[iteratorIdx].Next())
 		{
 			if (this->initialZero)
@@ -350,6 +358,27 @@ private:
 		return false;
 	}
 
+	// Lets the linear iterator skip whole cache blocks which NextSingleIterator would reject one at a time
+	void SetPrune()
+	{
+		auto& iterator = iterators[iteratorIdx];
+		iterator.ClearPrune();
+		bool pruneNegativeDelta = this->initialZero;
+#if defined INITIAL_DATA_SYMMETRIC
+		pruneNegativeDelta = true;
+#endif
+		if (pruneNegativeDelta && iteratorIdx <= firstIteratorWithNonZeroDataDelta)
+			iterator.PruneNegativeDelta();
+		if (this->initialZero && iteratorIdx == 0)
+			iterator.PruneCentre(0);
+		if (iteratorIdx > 0 && brackets[iteratorIdx - 1].bracket == Bracket::LEFT && brackets[iteratorIdx].bracket == Bracket::RIGHT)
+		{
+			iterator.PruneCentre(static_cast<uint8_t>(256 - iteratorSizes[iteratorIdx]));
+			if (iteratorSizes[iteratorIdx] > 1)
+				iterator.PruneCentre(static_cast<uint8_t>(iteratorSizes[iteratorIdx]));
+		}
+	}
+
 	bool NextBrackets()
 	{
 	restart:;
@@ -601,8 +630,10 @@ private:
 private:
 	uint8_t data[data_size + 2 * cache_data_size];
 	uint_fast32_t dataIdx;
+	// Cells outside [dataBoundLow, dataBoundHigh) are zero; only this range is reset between executions
 	uint_fast32_t dataBoundLow;
 	uint_fast32_t dataBoundHigh;
+	CycleDetector<data_size + 2 * cache_data_size> cycles;
 	
 	ModDivisionTable* divisionTable;
 
@@ -619,16 +650,25 @@ public:
 
 		uint_fast32_t programIdx = 0;
 		dataIdx = data_size / 2 + cache_data_size;
-		//dataBoundLow = dataIdx;
-		//dataBoundHigh = dataIdx + 1;
-		
-		memset(data, 0, data_size + 2 * cache_data_size);
+
+		ClearData();
 		memcpy(data + dataIdx, initialData, initialDataSize);
+		TouchData(dataIdx, dataIdx + initialDataSize);
 
 		uint_fast32_t remainingJumps = MAX_JUMPS;
+#ifdef DETECT_CYCLES
+		cycles.Reset();
+#endif
 		while (remainingJumps--)
 		{
-			auto iteratorData = iterators[programIdx].Data();
+#ifdef DETECT_CYCLES
+			// A repeat without output in between can only go on until the jumps run out
+			if (cycles.Cycled(programIdx, dataIdx, *targetOutputIdx, data, dataBoundLow, dataBoundHigh))
+			{
+				return false;
+			}
+#endif
+			auto& iteratorData = iterators[programIdx].Data();
 			// is of the form '[*]' where * is only <>+-
 			bool isLinear = jumps[programIdx].nonzero == programIdx;
 
@@ -741,6 +781,8 @@ public:
 		uint_fast32_t programIdx = 0;
 		dataIdx = initialDataIdx;
 		memcpy(data, initialData, data_size + 2 * cache_data_size);
+		dataBoundLow = 0;
+		dataBoundHigh = data_size + 2 * cache_data_size;
 
 #ifdef MINIMUM_NONZERO_DEPTH_OUTPUT_EXECUTION_COUNT
 		uint_fast32_t output_execution_counts[max_program_size];
@@ -748,9 +790,19 @@ public:
 #endif
 
 		uint_fast32_t remainingJumps = MAX_JUMPS;
+#ifdef DETECT_CYCLES
+		cycles.Reset();
+#endif
 		while (remainingJumps--)
 		{
-			auto iteratorData = iterators[programIdx].Data();
+#ifdef DETECT_CYCLES
+			// A repeat without output in between can only go on until the jumps run out
+			if (cycles.Cycled(programIdx, dataIdx, *targetOutputIdx, data, dataBoundLow, dataBoundHigh))
+			{
+				return false;
+			}
+#endif
+			auto& iteratorData = iterators[programIdx].Data();
 			// is of the form '[*]' where * is only <>+-
 			bool isLinear = jumps[programIdx].nonzero == programIdx;
 
@@ -878,43 +930,43 @@ public:
 
 	inline bool DataEqual(const uint8_t* otherData, uint_fast32_t count)
 	{
-		for (uint_fast32_t i = 0; i < count; i++)
-		{
-			if (data[i + dataIdx] != otherData[i]) return false;
-		}
-		return true;
+		return CellsEqual(data + dataIdx, otherData, count);
 	}
 
 	inline bool DataEqual(const char* otherData, uint_fast32_t count)
 	{
-		for (uint_fast32_t i = 0; i < count; i++)
-		{
-			if (data[i + dataIdx] != static_cast<uint8_t>(otherData[i])) return false;
-		}
-		return true;
+		return CellsEqual(data + dataIdx, otherData, count);
 	}
 
 private:
 	inline void ApplyData(AlignedData<cache_data_size>& argData)
 	{
-		//uint_fast32_t sseLow = argData.start / 16;
-		//uint_fast32_t sseHigh = argData.end / 16;
-		//
-		//__m128i sseArgData = reinterpret_cast<__m128i*> argData.data;
-		//__m123i sseData = reinterpret_cast<__m128i*> data + dataIdx;
-
-		for (int_fast32_t i = argData.start; i < argData.end; i++)
-		{
-			data[dataIdx + i] += argData.data[i + cache_data_size / 2];
-		}
+		AddEffect(data + dataIdx, argData);
+		TouchData(dataIdx + argData.start, dataIdx + argData.end);
 	}
 
 	inline void ApplyDataMult(AlignedData<cache_data_size>& argData, uint8_t m)
 	{
-		for (int_fast32_t i = argData.start; i < argData.end; i++)
+		AddEffectMult(data + dataIdx, argData, m);
+		TouchData(dataIdx + argData.start, dataIdx + argData.end);
+	}
+
+	inline void TouchData(uint_fast32_t low, uint_fast32_t high)
+	{
+		if (low >= high) return;
+		dataBoundLow = Min(dataBoundLow, low);
+		dataBoundHigh = Max(dataBoundHigh, high);
+	}
+
+	// Zeroes the cells the last execution may have changed
+	inline void ClearData()
+	{
+		if (dataBoundLow < dataBoundHigh)
 		{
-			data[dataIdx + i] += argData.data[i + cache_data_size / 2] * m;
+			memset(data + dataBoundLow, 0, dataBoundHigh - dataBoundLow);
 		}
+		dataBoundLow = data_size + 2 * cache_data_size;
+		dataBoundHigh = 0;
 	}
 
 public:
@@ -943,8 +995,10 @@ public:
 
 	void PrintData()
 	{
-		for (uint_fast32_t i = dataBoundLow; i <= dataBoundHigh; i++)
+		uint_fast32_t low = Min(dataBoundLow, dataIdx);
+		uint_fast32_t high = Max(dataBoundHigh, dataIdx + 1);
+		for (uint_fast32_t i = low; i < high; i++)
 			std::cout << std::setw(4) << (int)data[i];
-		std::cout << std::endl << std::string((dataIdx - dataBoundLow) * 4, ' ') << "  ^" << std::endl;
+		std::cout << std::endl << std::string((dataIdx - low) * 4, ' ') << "  ^" << std::endl;
 	}
 };
@@ -2,9 +2,14 @@
 
 #include <assert.h>
 #include <locale>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <vector>
+#include <algorithm>
 #include "LinearIterator.h"
 #include "ModDivisionTable.h"
+#include "CycleDetector.h"
 
 #define SINGLE_BRACKET_HIERARCHY
 #define MAX_BRACKET_DEPTH 2
@@ -12,6 +17,9 @@
 #define SHORT_CIRCUIT_LINEAR_SINGULAR
 #define INITIAL_ZERO
 // #define INITIAL_DATA_SYMMETRIC
+#define MIRROR_CANONICAL
+#define REPEAT_LOOPS
+#define DETECT_CYCLES
 // #define SINGLE_ITER_COUNT 5
 #define NO_ENDING
 #define MAX_FIRST_SIZE 1
@@ -22,7 +30,10 @@ class ProgramIterator
 {
 public:
 	ProgramIterator()
+		: dataBoundLow(0), dataBoundHigh(0), lastExecutionCentreFailure(false), snapshotCount(0), snapshotInputSize(0),
+		changedIterator(0), executionIdx(0), repeatedLoop(max_program_size)
 	{
+		memset(data, 0, data_size + 2 * cache_data_size);
 	}
 	~ProgramIterator()
 	{
@@ -34,6 +45,7 @@ public:
 		for (uint_fast32_t i = 0; i < max_program_size; i++)
 		{
 			iterators[i].SetCache(cache);
+			iterators[i].SetCompositeSet(&compositeSet);
 		}
 	}
 
@@ -51,10 +63,12 @@ private:
 	uint_fast32_t iteratorCount;
 	int_fast32_t iteratorSizes[max_program_size];
 	LinearIterator<cache_data_size, cache_size, max_program_size> iterators[max_program_size];
+	// Lets the iterators skip repeated composites of segments too long for the cache's masks
+	CompositeSet compositeSet;
 	
 	int_fast32_t remainingSize;
 	
-	enum class Bracket
+	enum class Bracket : uint8_t
 	{
 		EMPTY,
 		LEFT,
@@ -63,39 +77,75 @@ private:
 	struct { Bracket bracket; uint_fast32_t depth; } brackets[max_program_size];
 	struct { uint_fast32_t zero; uint_fast32_t nonzero; } jumps[max_program_size];
 	int_fast32_t bracketIdx;
+
+	// One bracket skeleton over one vector of iterator sizes, with the rank of its first candidate
+	struct Shape
+	{
+		uint8_t iteratorCount;
+		uint8_t iteratorSizes[max_program_size];
+		Bracket brackets[max_program_size];
+		struct { uint8_t zero; uint8_t nonzero; } jumps[max_program_size];
+		// Index of the size vector among all generated, with or without skeletons; a strided Start takes every threadDelta'th
+		uint_fast32_t sizesIdx;
+		uint_fast64_t count;
+		uint_fast64_t offset;
+	};
+public:
+	// Skeleton rules applied by CheckShape; the loops they reject are never entered, never exited or run at most once
+	enum class ShapeRule : uint8_t
+	{
+		DEAD_LOOP,
+		EMPTY_LOOP,
+		SINGLE_PASS_LOOP,
+		ACCEPTED
+	};
+
+private:
+	struct ShapeTable
+	{
+		std::vector<Shape> shapes;
+		uint_fast64_t total = 0;
+		// Candidates of the skeletons each rule rejected
+		uint_fast64_t removed[static_cast<uint_fast32_t>(ShapeRule::ACCEPTED)] = {};
+	};
+	const ShapeTable* shapeTable;
+	uint_fast32_t shapeIdx;
 	
 	int_fast32_t iteratorIdx;
 
+	// Iterators up to this one still have to pick the orientation of a program and its mirror image
 	int_fast32_t firstIteratorWithNonZeroDataDelta;
 
-	std::mutex serializeLock;
+	// Candidates are ranked by skeleton in enumeration order, then by iterator positions with the last iterator varying fastest
+	uint_fast64_t shapeRank;
+	uint_fast64_t currentShapeCount;
+	uint_fast64_t rankBegin, rankEnd;
+
+	// Iterators below rankedIterators resume from rankedPositions while all iterators before them are still at theirs
+	int_fast32_t rankedIterators;
+	uint_fast64_t rankedPositions[max_program_size];
 
 public:
 	uint_fast64_t currentCount;
 
+	// Counted without generating any skeleton; the table built by the first Start gives the same total
 	uint_fast64_t TotalCount(uint_fast32_t programSize)
 	{
 		uint_fast64_t result = 0;
-		
-		Start(programSize, 0, 1);
-		while (true)
+#ifdef SINGLE_ITER_COUNT
+		for (uint_fast32_t count = SINGLE_ITER_COUNT; count == SINGLE_ITER_COUNT && count <= programSize; count++)
+#else
+		for (uint_fast32_t count = 3; count <= programSize && count <= max_program_size; count += 2)
+#endif
 		{
-			uint_fast64_t iteratorsResult = 1;
-			for (uint_fast32_t i = 0; i < iteratorCount; i++)
-			{
-				iteratorsResult *= iterators[0].SizeCount(iteratorSizes[i]);
-			}
-			result += iteratorsResult;
-
-			while (!NextBrackets())
-			{
-				if (!NextValidIteratorSizes(threadDelta))
-				{
-					return result;
-				}
-				bracketIdx = 0;
-			}
+			result += CountShapes(programSize, count);
 		}
+		return result;
+	}
+
+	uint_fast64_t RemovedCount(uint_fast32_t programSize, ShapeRule rule)
+	{
+		return Shapes(programSize).removed[static_cast<uint_fast32_t>(rule)];
 	}
 
 	void Start(uint_fast32_t programSize, uint_fast32_t threadOffset, uint_fast32_t threadDelta)
@@ -106,50 +156,116 @@ public:
 		this->threadOffset = threadOffset;
 		this->threadDelta = threadDelta;
 
-		memset(iteratorSizes, 0, max_program_size * sizeof(int_fast32_t));
+		rankBegin = 0;
+		rankEnd = UINT_FAST64_MAX;
 
-		iteratorCount = 1;
-		iteratorSizes[0] = programSize;
-		firstIteratorWithNonZeroDataDelta = 0;
-		lastExecutionMaxProgramIdx = 0;
-		bracketIdx = 0;
+		shapeTable = &Shapes(programSize);
+		shapeIdx = NextThreadShape(0);
+		if (shapeIdx == shapeTable->shapes.size())
+		{
+			shapeRank = shapeTable->total;
+			Finish();
+			return;
+		}
+		EnterShape();
+	}
 
-		bracketIdx = 0;
-		brackets[0].bracket = Bracket::EMPTY;
-		brackets[0].depth = 0;
-		jumps[0].zero = jumps[0].nonzero = 1;
-		
-		if (!NextValidIteratorSizes(threadOffset))
+	// Walks only the candidates with rankBegin <= Rank() < rankEnd
+	void StartRange(uint_fast32_t programSize, uint_fast64_t rankBegin, uint_fast64_t rankEnd)
+	{
+		Start(programSize, 0, 1);
+		if (rankBegin >= rankEnd || rankBegin >= shapeTable->total)
 		{
+			Finish();
 			return;
 		}
-		bracketIdx = 0;
-		while (!NextBrackets())
+
+		auto& shapes = shapeTable->shapes;
+		shapeIdx = std::upper_bound(shapes.begin(), shapes.end(), rankBegin,
+			[](uint_fast64_t rank, const Shape& shape) { return rank < shape.offset; }) - shapes.begin() - 1;
+		EnterShape();
+		this->rankBegin = rankBegin;
+		this->rankEnd = rankEnd;
+
+		uint_fast64_t offset = rankBegin - shapeRank;
+		for (int_fast32_t i = iteratorCount - 1; i >= 0; i--)
 		{
-			if (!NextValidIteratorSizes(threadDelta))
-			{
-				return;
-			}
-			bracketIdx = 0;
+			uint_fast64_t count = iterators[0].SizeCount(iteratorSizes[i]);
+			rankedPositions[i] = offset % count;
+			offset /= count;
 		}
-		lastExecutionMaxProgramIdx = iteratorCount - 1;
+		rankedIterators = iteratorCount;
+		iterators[0].StartAt(iteratorSizes[0], rankedPositions[0]);
+	}
 
-		iteratorIdx = 0;
-		iterators[0].Start(iteratorSizes[0]);
+	// Moves to candidate rank; returns false if Next would skip it
+	bool Unrank(uint_fast32_t programSize, uint_fast64_t rank)
+	{
+		StartRange(programSize, rank, rank + 1);
+		return Next();
 	}
 
-	void Serialize(std::ostream& output)
+	// Gives away the upper half of the candidates after the current one, keeping at least minimum of them here; false if the range is too small to split
+	bool Split(uint_fast64_t minimum, uint_fast64_t& begin, uint_fast64_t& end)
 	{
-		serializeLock.lock();
+		uint_fast64_t position = NextRank();
+		if (rankEnd - position < 2 * minimum)
+		{
+			return false;
+		}
+		begin = position + (rankEnd - position) / 2;
+		end = rankEnd;
+		rankEnd = begin;
+		return true;
+	}
 
-		output << programSize << " " << threadOffset << " " << threadDelta << "\n";
-		output << currentCount << "\n";
-		output << iteratorCount << "\n";
+	// StartRange(programSize, begin, end) resumes this walk at the current candidate, or after it if currentDone; returns how many candidates of the range come before begin
+	// Like Split, only the thread calling Next may call this, between two calls
+	uint_fast64_t Checkpoint(bool currentDone, uint_fast64_t& begin, uint_fast64_t& end)
+	{
+		if (iteratorIdx < 0)
+			begin = rankEnd;
+		else if (rankedIterators > 0)
+			begin = rankBegin;
+		else
+			begin = Min<uint_fast64_t>(Rank() + currentDone, rankEnd);
+		end = rankEnd;
+		return begin - rankBegin;
+	}
+
+	// Candidates left in the range after the current one, as Split counts them
+	uint_fast64_t Remaining()
+	{
+		return rankEnd - NextRank();
+	}
+
+	// First rank after the current candidate, or the range's start before Next has reached it
+	uint_fast64_t NextRank()
+	{
+		if (iteratorIdx < 0)
+			return rankEnd;
+		if (rankedIterators > 0)
+			return rankBegin;
+		return Min<uint_fast64_t>(Rank() + 1, rankEnd);
+	}
+
+	// Position of the current candidate among all TotalCount(programSize) candidates, whatever the thread split
+	uint_fast64_t Rank()
+	{
+		uint_fast64_t rank = 0;
 		for (uint_fast32_t i = 0; i < iteratorCount; i++)
 		{
-			output << iteratorSizes[i] << " ";
+			rank = rank * iterators[0].SizeCount(iteratorSizes[i]) + iterators[i].Position();
 		}
-		output << "\n";
+		return shapeRank + rank;
+	}
+
+	// Not safe while another thread runs Next; a running search publishes Checkpoint instead
+	void Serialize(std::ostream& output)
+	{
+		output << programSize << " " << threadOffset << " " << threadDelta << "\n";
+		output << currentCount << "\n";
+		output << shapeIdx << " " << iteratorCount << "\n";
 		for (uint_fast32_t i = 0; i < iteratorCount; i++)
 		{
 			output << " ";
@@ -157,140 +273,385 @@ public:
 			output << "\n";
 		}
 		output << "\n";
-		for (uint_fast32_t i = 0; i < iteratorCount - 1; i++)
-		{
-			output << " " << (brackets[i].bracket == Bracket::EMPTY ? 0 : brackets[i].bracket == Bracket::LEFT ? 1 : 2) << " " << brackets[i].depth << "\n";
-		}
-		output << "\n";
-		for (uint_fast32_t i = 0; i < iteratorCount - 1; i++)
+		output << iteratorIdx << "\n";
+		output << firstIteratorWithNonZeroDataDelta << " " << lastExecutionSuccessful << " " << lastExecutionMaxProgramIdx << "\n";
+		output << shapeRank << " " << currentShapeCount << " " << rankBegin << " " << rankEnd << "\n";
+		output << rankedIterators;
+		for (int_fast32_t i = 0; i < rankedIterators; i++)
 		{
-			output << " " << jumps[i].zero << " " << jumps[i].nonzero << "\n";
+			output << " " << rankedPositions[i];
 		}
 		output << "\n";
-		output << iteratorIdx << " " << bracketIdx << " " << remainingSize << "\n";
-		output << firstIteratorWithNonZeroDataDelta << " " << lastExecutionSuccessful << " " << lastExecutionMaxProgramIdx << "\n";
-
-		serializeLock.unlock();
 	}
 
 	bool Deserialize(std::istream& input)
 	{
-		serializeLock.lock();
-
 		input >> programSize >> threadOffset >> threadDelta;
 		input >> currentCount;
-		input >> iteratorCount;
-		for (uint_fast32_t i = 0; i < iteratorCount; i++)
+		input >> shapeIdx >> iteratorCount;
+		shapeTable = &Shapes(programSize);
+		if (shapeIdx < shapeTable->shapes.size())
 		{
-			input >> iteratorSizes[i];
+			LoadShape();
 		}
 		for (uint_fast32_t i = 0; i < iteratorCount; i++)
 		{
 			if (!iterators[i].Deserialize(input))
 			{
-				serializeLock.unlock();
 				return false;
 			}
 		}
-		for (uint_fast32_t i = 0; i < iteratorCount - 1; i++)
-		{
-			int bracketInt;
-			input >> bracketInt >> brackets[i].depth;
-			brackets[i].bracket = bracketInt == 0 ? Bracket::EMPTY : bracketInt == 1 ? Bracket::LEFT : Bracket::RIGHT;
-		}
-		for (uint_fast32_t i = 0; i < iteratorCount - 1; i++)
+		input >> iteratorIdx;
+		changedIterator = 0;
+		input >> firstIteratorWithNonZeroDataDelta >> lastExecutionSuccessful >> lastExecutionMaxProgramIdx;
+		input >> shapeRank >> currentShapeCount >> rankBegin >> rankEnd;
+		input >> rankedIterators;
+		for (int_fast32_t i = 0; i < rankedIterators; i++)
 		{
-			input >> jumps[i].zero >> jumps[i].nonzero;
+			input >> rankedPositions[i];
 		}
-		input >> iteratorIdx >> bracketIdx >> remainingSize;
-		input >> firstIteratorWithNonZeroDataDelta >> lastExecutionSuccessful >> lastExecutionMaxProgramIdx;
 
-		serializeLock.unlock();
 		return true;
 	}
 
 	bool Next()
 	{
-		serializeLock.lock();
 		while (!NextIterators())
 		{
-			int_fast64_t iteratorsCount = 1;
-			for (uint_fast32_t i = 0; i < iteratorCount; i++)
+			if (!NextShape())
+			{
+				return false;
+			}
+		}
+		// Only the last skeleton of a range can run past its end
+		if (shapeRank + currentShapeCount > rankEnd && Rank() >= rankEnd)
+		{
+			NextShape();
+			return false;
+		}
+		return true;
+	}
+
+private:
+	uint_fast64_t ShapeCount()
+	{
+		uint_fast64_t result = 1;
+		for (uint_fast32_t i = 0; i < iteratorCount; i++)
+		{
+			result *= iterators[0].SizeCount(iteratorSizes[i]);
+		}
+		return result;
+	}
+
+#ifdef MAX_BRACKET_DEPTH
+	static const uint_fast32_t max_bracket_depth = MAX_BRACKET_DEPTH;
+#else
+	static const uint_fast32_t max_bracket_depth = max_program_size;
+#endif
+
+	// Sum of ShapeCount over the skeletons with count iterators, applying the rules of NextIteratorSizes, NextBrackets and CheckShape one iterator at a time
+	uint_fast64_t CountShapes(uint_fast32_t programSize, uint_fast32_t count)
+	{
+		uint_fast32_t sizeTotal = programSize - count + 1;
+
+		// ways[used][depth][left]: summed counts of the prefixes with used instructions in their iterators, ending at depth, with a left bracket last
+		uint_fast64_t ways[max_program_size + 1][max_bracket_depth + 1][2] = {};
+		uint_fast64_t next[max_program_size + 1][max_bracket_depth + 1][2];
+		ways[0][0][0] = 1;
+
+		for (uint_fast32_t i = 0; i < count - 1; i++)
+		{
+			uint_fast32_t minSize = 0;
+			uint_fast32_t maxSize = sizeTotal;
+			if (i == 0)
 			{
-				iteratorsCount *= iterators[0].SizeCount(iteratorSizes[i]);
+#ifdef INITIAL_ZERO
+				minSize = 1;
+#endif
+#ifdef MAX_FIRST_SIZE
+				maxSize = Min<uint_fast32_t>(maxSize, MAX_FIRST_SIZE);
+#endif
 			}
-			currentCount += iteratorsCount;
 
-			while (!NextBrackets())
+			memset(next, 0, sizeof(next));
+			for (uint_fast32_t used = 0; used <= sizeTotal; used++)
 			{
-				if (!NextValidIteratorSizes(threadDelta))
+				for (uint_fast32_t depth = 0; depth <= max_bracket_depth; depth++)
 				{
-					serializeLock.unlock();
-					return false;
+					for (uint_fast32_t left = 0; left < 2; left++)
+					{
+						if (ways[used][depth][left] == 0) continue;
+
+						for (uint_fast32_t size = minSize; size <= maxSize && used + size <= sizeTotal; size++)
+						{
+							uint_fast64_t weight = ways[used][depth][left] * iterators[0].SizeCount(size);
+
+							bool leftValid = count - i - 1 >= depth + 2
+								&& (size > 0 || left)
+								&& depth < max_bracket_depth
+#ifdef SINGLE_BRACKET_HIERARCHY
+								&& (i == 0 || depth > 0)
+#endif
+								;
+							if (leftValid)
+							{
+								next[used + size][depth + 1][1] += weight;
+							}
+							if (i > 0 && depth > 0 && size > 0)
+							{
+								next[used + size][depth - 1][0] += weight;
+							}
+						}
+					}
 				}
-				bracketIdx = 0;
 			}
-			iteratorIdx = 0;
-			iterators[0].Start(iteratorSizes[0]);
-			lastExecutionMaxProgramIdx = iteratorCount - 1;
+			memcpy(ways, next, sizeof(ways));
 		}
-		serializeLock.unlock();
-		return true;
+
+		uint_fast64_t result = 0;
+		for (uint_fast32_t used = 0; used <= sizeTotal; used++)
+		{
+#ifdef NO_ENDING
+			if (used != sizeTotal) continue;
+#endif
+			for (uint_fast32_t depth = 0; depth <= max_bracket_depth; depth++)
+			{
+				result += (ways[used][depth][0] + ways[used][depth][1]) * iterators[0].SizeCount(sizeTotal - used);
+			}
+		}
+		return result;
 	}
 
-private:
-	bool NextValidIteratorSizes(uint_fast32_t count)
+	// Skeletons are built once per cache and program size, then shared read-only by all iterators
+	const ShapeTable& Shapes(uint_fast32_t programSize)
 	{
-		for (int_fast32_t c = count; c > 0; c--)
+		static std::mutex tablesLock;
+		static std::map<std::pair<uint_fast64_t, uint_fast32_t>, std::unique_ptr<ShapeTable>> tables;
+
+		std::lock_guard<std::mutex> guard(tablesLock);
+		auto& table = tables[std::make_pair(cache->identity, programSize)];
+		if (!table)
+		{
+			table = std::make_unique<ShapeTable>();
+			BuildShapes(programSize, *table);
+		}
+		return *table;
+	}
+
+	// Generates the skeletons in enumeration order with NextValidIteratorSizes and NextBrackets, keeping those CheckShape accepts
+	void BuildShapes(uint_fast32_t programSize, ShapeTable& table)
+	{
+		this->programSize = programSize;
+
+		memset(iteratorSizes, 0, max_program_size * sizeof(int_fast32_t));
+		iteratorCount = 1;
+		iteratorSizes[0] = programSize;
+		for (uint_fast32_t i = 0; i < max_program_size; i++)
 		{
-			while (!NextIteratorSizes())
+			brackets[i].bracket = Bracket::EMPTY;
+			brackets[i].depth = 0;
+		}
+
+		uint_fast32_t sizesIdx = 0;
+		do
+		{
+			bracketIdx = 0;
+			while (NextBrackets())
 			{
+				ShapeRule rule = CheckShape();
+				if (rule != ShapeRule::ACCEPTED)
+				{
+					table.removed[static_cast<uint_fast32_t>(rule)] += ShapeCount();
+					continue;
+				}
+
+				Shape shape;
+				shape.iteratorCount = iteratorCount;
+				for (uint_fast32_t i = 0; i < iteratorCount; i++)
+				{
+					shape.iteratorSizes[i] = iteratorSizes[i];
+					shape.brackets[i] = brackets[i].bracket;
+					shape.jumps[i].zero = jumps[i].zero;
+					shape.jumps[i].nonzero = jumps[i].nonzero;
+				}
+				shape.sizesIdx = sizesIdx;
+				shape.count = ShapeCount();
+				shape.offset = table.total;
+				table.total += shape.count;
+				table.shapes.push_back(shape);
+			}
+			sizesIdx++;
+		}
+		while (NextValidIteratorSizes());
+
+		assert(table.total == TotalCount(programSize));
+	}
+
+	// First rule the current skeleton breaks, checked bracket by bracket
+	ShapeRule CheckShape()
+	{
+		for (uint_fast32_t i = 0; i < iteratorCount - 1; i++)
+		{
+			if (iteratorSizes[i] > 0)
+			{
+				continue;
+			}
+			Bracket previous = i == 0 ? Bracket::EMPTY : brackets[i - 1].bracket;
+			if (brackets[i].bracket == Bracket::LEFT)
+			{
+				// [ at the start or right after ] finds a zero cell
+				if (previous != Bracket::LEFT)
+				{
+					return ShapeRule::DEAD_LOOP;
+				}
+			}
+			else if (previous == Bracket::LEFT)
+			{
+				// [] never changes its cell
+				return ShapeRule::EMPTY_LOOP;
+			}
+			else
+			{
+				// ]] leaves the outer loop on the zero cell the inner one exits on, as in [[x]]
+				return ShapeRule::SINGLE_PASS_LOOP;
+			}
+		}
+		return ShapeRule::ACCEPTED;
+	}
+
+	// First skeleton from idx on which this thread takes
+	uint_fast32_t NextThreadShape(uint_fast32_t idx)
+	{
+		auto& shapes = shapeTable->shapes;
+		while (idx < shapes.size() && shapes[idx].sizesIdx % threadDelta != threadOffset)
+		{
+			idx++;
+		}
+		return idx;
+	}
+
+	void LoadShape()
+	{
+		auto& shape = shapeTable->shapes[shapeIdx];
+		iteratorCount = shape.iteratorCount;
+		for (uint_fast32_t i = 0; i < iteratorCount; i++)
+		{
+			iteratorSizes[i] = shape.iteratorSizes[i];
+			brackets[i].bracket = shape.brackets[i];
+			jumps[i].zero = shape.jumps[i].zero;
+			jumps[i].nonzero = shape.jumps[i].nonzero;
+		}
+		shapeRank = shape.offset;
+		currentShapeCount = shape.count;
+	}
+
+	void EnterShape()
+	{
+		LoadShape();
+		firstIteratorWithNonZeroDataDelta = 0;
+		rankedIterators = 0;
+		iteratorIdx = 0;
+		changedIterator = 0;
+		iterators[0].Start(iteratorSizes[0]);
+		lastExecutionMaxProgramIdx = iteratorCount - 1;
+	}
+
+	// Leaves the current skeleton; false, with every later call returning false too, once the range is done
+	bool NextShape()
+	{
+		if (shapeIdx >= shapeTable->shapes.size())
+		{
+			return false;
+		}
+
+		uint_fast64_t shapeEnd = shapeRank + currentShapeCount;
+		if (shapeEnd > rankBegin && shapeRank < rankEnd)
+		{
+			currentCount += Min(shapeEnd, rankEnd) - Max(shapeRank, rankBegin);
+		}
+		shapeRank = shapeEnd;
+
+		shapeIdx = NextThreadShape(shapeIdx + 1);
+		if (shapeIdx >= shapeTable->shapes.size() || shapeTable->shapes[shapeIdx].offset >= rankEnd)
+		{
+			Finish();
+			return false;
+		}
+		EnterShape();
+		return true;
+	}
+
+	void Finish()
+	{
+		rankBegin = rankEnd = shapeRank;
+		currentShapeCount = 0;
+		rankedIterators = 0;
+		iteratorIdx = -1;
+	}
+
+	bool NextValidIteratorSizes()
+	{
+		while (!NextIteratorSizes())
+		{
 #ifdef SINGLE_ITER_COUNT
-				if (iteratorCount == 1) iteratorCount = SINGLE_ITER_COUNT;
-				else return false;
+			if (iteratorCount == 1) iteratorCount = SINGLE_ITER_COUNT;
+			else return false;
 #else
-				iteratorCount += 2;
+			iteratorCount += 2;
 #endif
-				remainingSize = programSize - iteratorCount + 1;
-				if (remainingSize <= 0) return false;
+			remainingSize = programSize - iteratorCount + 1;
+			if (remainingSize <= 0) return false;
 
-				for (uint_fast32_t i = 0; i < iteratorCount - 2; i++)
-				{
-					assert(i >= 0 && i < max_program_size);
-					iteratorSizes[i] = 0;
-				}
+			for (uint_fast32_t i = 0; i < iteratorCount - 2; i++)
+			{
+				assert(i >= 0 && i < max_program_size);
+				iteratorSizes[i] = 0;
+			}
 #ifdef INITIAL_ZERO
-				iteratorSizes[0] = 1;
-				remainingSize--;
-				if (remainingSize < 0) return false;
+			iteratorSizes[0] = 1;
+			remainingSize--;
+			if (remainingSize < 0) return false;
 #endif
-				assert(iteratorCount - 2 >= 0 && iteratorCount - 2 < max_program_size);
-				// Set to -1 so that after the first call to NextIteratorSizes it will be 0
-				iteratorSizes[iteratorCount - 2] = -1;
-				remainingSize++;
-				firstIteratorWithNonZeroDataDelta = 0;
-			}
+			assert(iteratorCount - 2 >= 0 && iteratorCount - 2 < max_program_size);
+			// Set to -1 so that after the first call to NextIteratorSizes it will be 0
+			iteratorSizes[iteratorCount - 2] = -1;
+			remainingSize++;
 		}
 		return true;
 	}
 
 	bool NextIterators()
 	{
+		// Iterators after the deepest one a failed execution entered cannot change its outcome
 		if (iteratorIdx == iteratorCount - 1 && !lastExecutionSuccessful)
 		{
 			iteratorIdx = lastExecutionMaxProgramIdx;
+			if (lastExecutionCentreFailure)
+			{
+				iterators[iteratorIdx].SkipCentre();
+			}
 		}
 
 		while (iteratorIdx >= 0)
 		{
 			if (NextSingleIterator())
 			{
+				changedIterator = Min<uint_fast32_t>(changedIterator, iteratorIdx);
 				if (iteratorIdx == iteratorCount - 1)
 				{
+					rankedIterators = 0;
 					return true;
 				}
 				iteratorIdx++;
-				iterators[iteratorIdx].Start(iteratorSizes[iteratorIdx]);
+				if (iteratorIdx < rankedIterators && iterators[iteratorIdx - 1].Position() == rankedPositions[iteratorIdx - 1])
+				{
+					iterators[iteratorIdx].StartAt(iteratorSizes[iteratorIdx], rankedPositions[iteratorIdx]);
+				}
+				else
+				{
+					rankedIterators = 0;
+					iterators[iteratorIdx].Start(iteratorSizes[iteratorIdx]);
+				}
 			}
 			else
 			{
@@ -302,6 +663,7 @@ private:
 
 	bool NextSingleIterator()
 	{
+		SetPrune();
 		while (iterators[iteratorIdx].Next())
 		{
 #if defined INITIAL_ZERO || defined INITIAL_DATA_SYMMETRIC
@@ -319,7 +681,17 @@ private:
 				}
 				else
 				{
+#ifdef MIRROR_CANONICAL
+					// A balanced iterator which is not its own mirror image decides the orientation as a moving one does
+					int_fast32_t side = MirrorSide(iterators[iteratorIdx].Data());
+					if (side < 0)
+					{
+						continue;
+					}
+					firstIteratorWithNonZeroDataDelta = side > 0 ? iteratorIdx : iteratorIdx + 1;
+#else
 					firstIteratorWithNonZeroDataDelta = iteratorIdx + 1;
+#endif
 				}
 			}
 #endif
@@ -356,6 +728,42 @@ private:
 		return false;
 	}
 
+	// Sign of the first difference between the cells right and left of the centre, 0 if the effect is its own mirror image
+	static int_fast32_t MirrorSide(const AlignedData<cache_data_size>& effect)
+	{
+		for (uint_fast32_t i = 1; i < cache_data_size / 2; i++)
+		{
+			uint8_t right = effect.data[cache_data_size / 2 + i];
+			uint8_t left = effect.data[cache_data_size / 2 - i];
+			if (right != left)
+			{
+				return right > left ? 1 : -1;
+			}
+		}
+		return 0;
+	}
+
+	// Lets the linear iterator skip whole cache blocks which NextSingleIterator would reject one at a time
+	void SetPrune()
+	{
+		auto& iterator = iterators[iteratorIdx];
+		iterator.ClearPrune();
+#if defined INITIAL_ZERO || defined INITIAL_DATA_SYMMETRIC
+		if (iteratorIdx <= firstIteratorWithNonZeroDataDelta)
+			iterator.PruneNegativeDelta();
+#endif
+#ifdef INITIAL_ZERO
+		if (iteratorIdx == 0)
+			iterator.PruneCentre(0);
+#endif
+		if (iteratorIdx > 0 && brackets[iteratorIdx - 1].bracket == Bracket::LEFT && brackets[iteratorIdx].bracket == Bracket::RIGHT)
+		{
+			iterator.PruneCentre(static_cast<uint8_t>(256 - iteratorSizes[iteratorIdx]));
+			if (iteratorSizes[iteratorIdx] > 1)
+				iterator.PruneCentre(static_cast<uint8_t>(iteratorSizes[iteratorIdx]));
+		}
+	}
+
 	bool NextBrackets()
 	{
 		while (bracketIdx >= 0)
@@ -375,7 +783,7 @@ private:
 				}
 				else if (right_valid)
 				{
-					if (!SetBracketRight()) continue;
+					SetBracketRight();
 					if (bracketIdx == iteratorCount - 2)
 					{
 						SetJumps();
@@ -392,7 +800,7 @@ private:
 			{
 				if (right_valid)
 				{
-					if (!SetBracketRight()) continue;
+					SetBracketRight();
 					if (bracketIdx == iteratorCount - 2)
 					{
 						SetJumps();
@@ -421,10 +829,7 @@ private:
 		brackets[bracketIdx].bracket = Bracket::LEFT;
 		brackets[bracketIdx].depth = bracketIdx == 0 ? 1 : brackets[bracketIdx - 1].depth + 1;
 
-		return (
-			iteratorSizes[bracketIdx] > 0
-			|| (bracketIdx > 0 && brackets[bracketIdx - 1].bracket == Bracket::LEFT)
-		)
+		return true
 #ifdef MAX_BRACKET_DEPTH
 		&& brackets[bracketIdx].depth <= MAX_BRACKET_DEPTH
 #endif
@@ -434,13 +839,11 @@ private:
 		;
 	}
 
-	inline bool SetBracketRight()
+	inline void SetBracketRight()
 	{
 		assert(bracketIdx > 0 && bracketIdx < max_program_size);
 		brackets[bracketIdx].bracket = Bracket::RIGHT;
 		brackets[bracketIdx].depth = brackets[bracketIdx - 1].depth - 1;
-
-		return iteratorSizes[bracketIdx] > 0;
 	}
 
 	void SetJumps()
@@ -460,6 +863,8 @@ private:
 				jumps[i].nonzero = jumps[lbracket].nonzero = lbracket + 1;
 			}
 		}
+		// The last iterator closes no loop; Execute must not see a stale jump from a longer skeleton here
+		jumps[iteratorCount - 1].zero = jumps[iteratorCount - 1].nonzero = iteratorCount;
 	}
 
 	bool NextIteratorSizes()
@@ -499,35 +904,120 @@ private:
 private:
 	uint8_t data[data_size + 2 * cache_data_size];
 	uint_fast32_t dataIdx;
+	// Cells outside [dataBoundLow, dataBoundHigh) are zero; only this range is reset between executions
 	uint_fast32_t dataBoundLow;
 	uint_fast32_t dataBoundHigh;
 	
 	ModDivisionTable* divisionTable;
 
 	bool lastExecutionSuccessful;
+	// Deepest iterator entered, by any jump
 	uint_fast32_t lastExecutionMaxProgramIdx;
+	// Set if it failed as a linear loop on its first run; its cell came from earlier iterators, so every entry with the same centre fails alike
+	bool lastExecutionCentreFailure;
+
+	// Execution state on first entering an iterator; only iterators before it can have run, so it holds until one of them changes
+	struct Snapshot
+	{
+		uint_fast32_t programIdx;
+		uint8_t data[data_size + 2 * cache_data_size];
+		uint_fast32_t dataBoundLow;
+		uint_fast32_t dataBoundHigh;
+		uint_fast32_t dataIdx;
+		uint_fast32_t remainingJumps;
+	};
+	// Taken in increasing programIdx order by the last Execute, with snapshotInput as its initial data
+	Snapshot snapshots[max_program_size];
+	uint_fast32_t snapshotCount;
+	uint8_t snapshotInput[data_size];
+	uint_fast32_t snapshotInputSize;
+	// Lowest iterator moved since the last Execute
+	uint_fast32_t changedIterator;
+
+	// Cell read to pick the jump of each step, by number of jumps taken
+	uint8_t readLog[MAX_JUMPS];
+	// Passes of a loop, counted from its back jumps while they end at one cell; the last two are compared in readLog
+	struct LoopPasses
+	{
+		uint_fast64_t execution;
+		uint_fast32_t dataIdx;
+		uint_fast32_t count;
+		uint_fast32_t start;
+		uint_fast32_t previousStart;
+	};
+	LoopPasses loopPasses[max_program_size];
+	uint_fast64_t executionIdx;
+	// Loop whose pass in progress is identical to the rest of them, with passData the tape it started from
+	uint_fast32_t repeatedLoop;
+	uint8_t passData[data_size + 2 * cache_data_size];
+
+	CycleDetector<data_size + 2 * cache_data_size> cycles;
 
 public:
 	bool Execute(const char* initialData, const uint_fast32_t initialDataSize)
 	{
-		// TODO: short-circuit unbalanced linear loop if beyond bounds and ends on nonzero
-
 		lastExecutionSuccessful = false;
-		lastExecutionMaxProgramIdx = 0;
+		lastExecutionCentreFailure = false;
 
-		uint_fast32_t programIdx = 0;
-		dataIdx = data_size / 2 + cache_data_size;
-		//dataBoundLow = dataIdx;
-		//dataBoundHigh = dataIdx + 1;
-		
-		memset(data, 0, data_size + 2 * cache_data_size);
-		memcpy(data + dataIdx, initialData, initialDataSize);
+		if (initialDataSize != snapshotInputSize || memcmp(snapshotInput, initialData, initialDataSize) != 0)
+		{
+			snapshotCount = 0;
+			memcpy(snapshotInput, initialData, initialDataSize);
+			snapshotInputSize = initialDataSize;
+		}
+
+		while (snapshotCount > 0 && snapshots[snapshotCount - 1].programIdx > changedIterator)
+		{
+			snapshotCount--;
+		}
+		changedIterator = max_program_size;
+
+		uint_fast32_t programIdx;
+		uint_fast32_t remainingJumps;
+		if (snapshotCount > 0)
+		{
+			auto& snapshot = snapshots[snapshotCount - 1];
+			programIdx = snapshot.programIdx;
+			ClearData();
+			memcpy(data + snapshot.dataBoundLow, snapshot.data + snapshot.dataBoundLow, snapshot.dataBoundHigh - snapshot.dataBoundLow);
+			dataBoundLow = snapshot.dataBoundLow;
+			dataBoundHigh = snapshot.dataBoundHigh;
+			dataIdx = snapshot.dataIdx;
+			remainingJumps = snapshot.remainingJumps;
+			lastExecutionMaxProgramIdx = programIdx;
+		}
+		else
+		{
+			lastExecutionMaxProgramIdx = 0;
+
+			programIdx = 0;
+			dataIdx = data_size / 2 + cache_data_size;
+
+			ClearData();
+			memcpy(data + dataIdx, initialData, initialDataSize);
+			TouchData(dataIdx, dataIdx + initialDataSize);
+
+			remainingJumps = MAX_JUMPS;
+		}
+		bool firstRun = true;
+
+		executionIdx++;
+		repeatedLoop = max_program_size;
+#ifdef DETECT_CYCLES
+		cycles.Reset();
+#endif
 
-		uint_fast32_t remainingJumps = MAX_JUMPS;
 		while (remainingJumps--)
 		{
 			assert(programIdx < iteratorCount);
-			auto iteratorData = iterators[programIdx].Data();
+#ifdef DETECT_CYCLES
+			if (cycles.Cycled(programIdx, dataIdx, 0, data, dataBoundLow, dataBoundHigh))
+			{
+				return false;
+			}
+#endif
+
+			auto& iteratorData = iterators[programIdx].Data();
 			bool isLinear = jumps[programIdx].nonzero == programIdx;
 
 			// Technically may be incorrect if iterator size is greater than 256
@@ -541,9 +1031,13 @@ public:
 			if (isLinear && iterators[programIdx].IsBalanced())
 			{
 				uint8_t centerCell = iteratorData.data[iteratorData.idx + cache_data_size / 2];
+#ifdef REPEAT_LOOPS
+				readLog[MAX_JUMPS - 1 - remainingJumps] = data[dataIdx];
+#endif
 				int cnt = divisionTable->Get(data[dataIdx], centerCell);
 				if (cnt == -1)
 				{
+					lastExecutionCentreFailure = firstRun;
 					return false;
 				}
 
@@ -558,10 +1052,12 @@ public:
 				ApplyDataMult(iteratorData.data, cnt);
 #endif
 				programIdx = jumps[programIdx].zero;
+				firstRun = Enter(programIdx, remainingJumps);
 				continue;
 			}
 
 			uint_fast32_t newDataIdx = dataIdx + iteratorData.idx;
+			// Only loops move this far, and every iterator in the loop adds to its drift, so the failure stays with the deepest one entered
 			if (newDataIdx < cache_data_size || newDataIdx >= data_size + cache_data_size)
 			{
 				return false;
@@ -577,11 +1073,42 @@ public:
 			}
 
 			// TODO: test zero, nonzero in array
-			programIdx = (data[dataIdx] == 0) ? jumps[programIdx].zero : jumps[programIdx].nonzero;
-			if (programIdx > lastExecutionMaxProgramIdx)
+#ifdef REPEAT_LOOPS
+			uint_fast32_t step = MAX_JUMPS - 1 - remainingJumps;
+			readLog[step] = data[dataIdx];
+#endif
+			if (isLinear && data[dataIdx] != 0)
 			{
-				lastExecutionMaxProgramIdx = programIdx;
+				// Most unbalanced linear loops stop after one pass; the rest are run without going through the jumps
+				if (remainingJumps == 0)
+				{
+					return false;
+				}
+				remainingJumps--;
+				if (!ScanLoop(iteratorData, remainingJumps))
+				{
+					return false;
+				}
+				programIdx = jumps[programIdx].zero;
+				firstRun = Enter(programIdx, remainingJumps);
+				continue;
 			}
+#ifdef REPEAT_LOOPS
+			if (jumps[programIdx].nonzero <= programIdx)
+			{
+				if (data[dataIdx] == 0)
+				{
+					EndLoop(programIdx);
+				}
+				else if (RepeatLoop(programIdx, step, remainingJumps))
+				{
+					firstRun = Enter(programIdx, remainingJumps);
+					continue;
+				}
+			}
+#endif
+			programIdx = (data[dataIdx] == 0) ? jumps[programIdx].zero : jumps[programIdx].nonzero;
+			firstRun = Enter(programIdx, remainingJumps);
 		}
 		return false;
 	}
@@ -590,6 +1117,16 @@ public:
 	{
 		return data;
 	}
+
+	// Whether the current program's mirror image, with < and > swapped, was left out of the walk; with no initial data it leaves the reversed tape
+	inline bool HasMirror()
+	{
+#if defined INITIAL_ZERO || defined INITIAL_DATA_SYMMETRIC
+		return firstIteratorWithNonZeroDataDelta < static_cast<int_fast32_t>(iteratorCount);
+#else
+		return false;
+#endif
+	}
 	
 	inline uint_fast32_t DataIdx()
 	{
@@ -598,43 +1135,242 @@ public:
 
 	inline bool DataEqual(const uint8_t* otherData, uint_fast32_t count)
 	{
-		for (uint_fast32_t i = 0; i < count; i++)
+		return CellsEqual(data + dataIdx, otherData, count);
+	}
+
+	inline bool DataEqual(const char* otherData, uint_fast32_t count)
+	{
+		return CellsEqual(data + dataIdx, otherData, count);
+	}
+
+private:
+	// Runs the passes of an unbalanced linear loop from the one remainingJumps last counted. Returns false if it fails, else
+	// leaves dataIdx on the zero cell it stops at with the rest of its jumps taken off remainingJumps
+	bool ScanLoop(AlignedData<cache_data_size>& iteratorData, uint_fast32_t& remainingJumps)
+	{
+		const uint_fast32_t low = cache_data_size;
+		const uint_fast32_t high = data_size + cache_data_size;
+		const int_fast32_t half = cache_data_size / 2;
+		const int_fast32_t move = iteratorData.idx;
+		const int_fast32_t effectStart = iteratorData.start + half;
+		const int_fast32_t effectEnd = iteratorData.end + half;
+#ifdef REPEAT_LOOPS
+		uint8_t* log = readLog + (MAX_JUMPS - 1 - remainingJumps);
+#endif
+
+		if (effectStart >= effectEnd || FindFirst<false>(iteratorData.data, effectStart, effectEnd) == static_cast<uint_fast32_t>(effectEnd))
 		{
-			if (data[i + dataIdx] != otherData[i]) return false;
+			// Only the moves run, so the loop stops on the first zero cell along its stride
+			uint_fast32_t stop = high;
+			if (move == 1)
+			{
+				stop = FindFirst<true>(data, dataIdx + 1, high);
+			}
+			else if (move == -1)
+			{
+				stop = FindLast<true>(data, low, dataIdx);
+				if (stop == dataIdx) stop = high;
+			}
+			else
+			{
+				for (uint_fast32_t i = dataIdx + move; i >= low && i < high; i += move)
+				{
+					if (data[i] == 0)
+					{
+						stop = i;
+						break;
+					}
+				}
+			}
+			if (stop == high)
+			{
+				return false;
+			}
+
+			uint_fast32_t passes = (static_cast<int_fast32_t>(stop) - static_cast<int_fast32_t>(dataIdx)) / move;
+			if (passes - 1 > remainingJumps)
+			{
+				return false;
+			}
+#ifdef REPEAT_LOOPS
+			for (uint_fast32_t i = 0; i < passes; i++)
+			{
+				log[i] = data[dataIdx + (i + 1) * move];
+			}
+#endif
+			remainingJumps -= passes - 1;
+			dataIdx = stop;
+			return true;
 		}
-		return true;
+
+		// Past the last nonzero cell ahead, once every earlier pass reaching it has run, each cell read holds the sum of the effect
+		// along the stride; if that is nonzero the loop walks off the tape, so it fails as soon as it gets there
+		uint8_t strideSum = 0;
+		uint_fast32_t reachingPasses = 0;
+		for (int_fast32_t offset = move; offset >= -half && offset < half; offset += move)
+		{
+			if (offset >= iteratorData.start && offset < iteratorData.end)
+			{
+				strideSum += iteratorData.data[offset + half];
+				reachingPasses = offset / move;
+			}
+		}
+
+		uint_fast32_t failPasses = 0;
+		if (strideSum != 0)
+		{
+			uint_fast32_t from = Max(low, dataBoundLow);
+			uint_fast32_t to = Min(high, dataBoundHigh);
+			uint_fast32_t frontier = move > 0 ? FindLast<false>(data, from, to) : FindFirst<false>(data, from, to);
+			uint_fast32_t frontierPasses = 1;
+			if (frontier != to && (move > 0 ? frontier >= dataIdx : frontier <= dataIdx))
+			{
+				frontierPasses = (move > 0 ? frontier - dataIdx : dataIdx - frontier) / (move > 0 ? move : -move) + 1;
+			}
+			failPasses = Max(reachingPasses, frontierPasses);
+		}
+
+		for (uint_fast32_t passes = 1; passes - 1 <= remainingJumps; passes++)
+		{
+			if (passes == failPasses)
+			{
+				return false;
+			}
+			ApplyData(iteratorData);
+			uint_fast32_t newDataIdx = dataIdx + move;
+			if (newDataIdx < low || newDataIdx >= high)
+			{
+				return false;
+			}
+			dataIdx = newDataIdx;
+#ifdef REPEAT_LOOPS
+			log[passes - 1] = data[dataIdx];
+#endif
+			if (data[dataIdx] == 0)
+			{
+				remainingJumps -= passes - 1;
+				return true;
+			}
+		}
+		return false;
 	}
 
-	inline bool DataEqual(const char* otherData, uint_fast32_t count)
+	// Called on the back jump of the loop ending at end. Once two passes in a row end where they started and read the same values
+	// before the loop's own read, so does every later one; the next pass gives the delta each adds, and the rest are added at once.
+	// Returns true with programIdx past the loop and its jumps taken off remainingJumps if they were; a loop which runs out of jumps,
+	// or never ends as no count of deltas clears its cell, takes all of them
+	bool RepeatLoop(uint_fast32_t& programIdx, uint_fast32_t step, uint_fast32_t& remainingJumps)
 	{
-		for (uint_fast32_t i = 0; i < count; i++)
+		uint_fast32_t end = programIdx;
+		auto& passes = loopPasses[end];
+		if (repeatedLoop == end)
+		{
+			repeatedLoop = max_program_size;
+			passes.execution = 0;
+
+			int cnt = divisionTable->Get(data[dataIdx], static_cast<uint8_t>(data[dataIdx] - passData[dataIdx]));
+			uint_fast32_t passJumps = step + 1 - passes.start;
+			if (cnt == -1 || static_cast<uint_fast32_t>(cnt) * passJumps > remainingJumps)
+			{
+				remainingJumps = 0;
+				return true;
+			}
+
+			// The pass changes the cells its predecessor did, which were already in the bounds
+			for (uint_fast32_t i = dataBoundLow; i < dataBoundHigh; i++)
+			{
+				data[i] += static_cast<uint8_t>((data[i] - passData[i]) * cnt);
+			}
+			remainingJumps -= cnt * passJumps;
+			programIdx = jumps[end].zero;
+			return true;
+		}
+
+		if (passes.execution != executionIdx || passes.dataIdx != dataIdx)
 		{
-			if (data[i + dataIdx] != static_cast<uint8_t>(otherData[i])) return false;
+			passes.execution = executionIdx;
+			passes.dataIdx = dataIdx;
+			passes.count = 0;
 		}
-		return true;
+		else if (passes.count >= 2 && repeatedLoop == max_program_size)
+		{
+			uint_fast32_t length = step - passes.start;
+			if (passes.start - passes.previousStart == length + 1 &&
+				memcmp(readLog + passes.previousStart, readLog + passes.start, length) == 0)
+			{
+				repeatedLoop = end;
+				memcpy(passData + dataBoundLow, data + dataBoundLow, dataBoundHigh - dataBoundLow);
+			}
+		}
+		passes.count++;
+		passes.previousStart = passes.start;
+		passes.start = step + 1;
+		return false;
 	}
 
-private:
-	inline void ApplyData(AlignedData<cache_data_size>& argData)
+	inline void EndLoop(uint_fast32_t end)
 	{
-		//uint_fast32_t sseLow = argData.start / 16;
-		//uint_fast32_t sseHigh = argData.end / 16;
-		//
-		//__m128i sseArgData = reinterpret_cast<__m128i*> argData.data;
-		//__m123i sseData = reinterpret_cast<__m128i*> data + dataIdx;
+		loopPasses[end].execution = 0;
+		if (repeatedLoop == end)
+		{
+			repeatedLoop = max_program_size;
+		}
+	}
 
-		for (int_fast32_t i = argData.start; i < argData.end; i++)
+	// Returns whether this is the first time programIdx runs; iterators are first entered in increasing order
+	inline bool Enter(uint_fast32_t programIdx, uint_fast32_t remainingJumps)
+	{
+		if (programIdx <= lastExecutionMaxProgramIdx)
 		{
-			data[dataIdx + i] += argData.data[i + cache_data_size / 2];
+			return false;
 		}
+		lastExecutionMaxProgramIdx = programIdx;
+		TakeSnapshot(programIdx, remainingJumps);
+		return true;
+	}
+
+	// The last iterator returns as soon as it runs, so entering it is not worth a snapshot
+	inline void TakeSnapshot(uint_fast32_t programIdx, uint_fast32_t remainingJumps)
+	{
+		if (programIdx >= iteratorCount - 1) return;
+
+		auto& snapshot = snapshots[snapshotCount++];
+		snapshot.programIdx = programIdx;
+		memcpy(snapshot.data + dataBoundLow, data + dataBoundLow, dataBoundHigh - dataBoundLow);
+		snapshot.dataBoundLow = dataBoundLow;
+		snapshot.dataBoundHigh = dataBoundHigh;
+		snapshot.dataIdx = dataIdx;
+		snapshot.remainingJumps = remainingJumps;
+	}
+
+	inline void ApplyData(AlignedData<cache_data_size>& argData)
+	{
+		AddEffect(data + dataIdx, argData);
+		TouchData(dataIdx + argData.start, dataIdx + argData.end);
 	}
 
 	inline void ApplyDataMult(AlignedData<cache_data_size>& argData, uint8_t m)
 	{
-		for (int_fast32_t i = argData.start; i < argData.end; i++)
+		AddEffectMult(data + dataIdx, argData, m);
+		TouchData(dataIdx + argData.start, dataIdx + argData.end);
+	}
+
+	inline void TouchData(uint_fast32_t low, uint_fast32_t high)
+	{
+		if (low >= high) return;
+		dataBoundLow = Min(dataBoundLow, low);
+		dataBoundHigh = Max(dataBoundHigh, high);
+	}
+
+	// Zeroes the cells the last execution may have changed
+	inline void ClearData()
+	{
+		if (dataBoundLow < dataBoundHigh)
 		{
-			data[dataIdx + i] += argData.data[i + cache_data_size / 2] * m;
+			memset(data + dataBoundLow, 0, dataBoundHigh - dataBoundLow);
 		}
+		dataBoundLow = data_size + 2 * cache_data_size;
+		dataBoundHigh = 0;
 	}
 
 public:
@@ -642,10 +1378,14 @@ public:
 	{
 		uint8_t currentData[data_size];
 		memcpy(currentData, data + cache_data_size, data_size);
-		return StringDistanceRecursive(target, targetSize, shortCircuit, currentData, dataIdx - cache_data_size);
+		int_fast32_t low, high;
+		StringDistanceBounds(low, high);
+		return StringDistanceRecursive(target, targetSize, shortCircuit, currentData, dataIdx - cache_data_size, low, high);
 	}
 
-	uint_fast32_t StringDistanceRecursive(const char* target, uint_fast32_t targetSize, uint_fast32_t shortCircuit, uint8_t* currentData, uint_fast32_t currentDataIdx)
+	// Cells of currentData outside [low, high) are zero
+	uint_fast32_t StringDistanceRecursive(const char* target, uint_fast32_t targetSize, uint_fast32_t shortCircuit, uint8_t* currentData, uint_fast32_t currentDataIdx,
+		int_fast32_t low, int_fast32_t high)
 	{
 		if (targetSize == 0)
 		{
@@ -655,9 +1395,14 @@ public:
 		uint_fast32_t bestScore = 100000;
 		char c = target[0];
 
+		// Loops over the nonzero cells stop within 8 cells of them, and cells further than shortCircuit are too far to move to,
+		// so the cells past both are never picked
+		uint_fast32_t scanLow = Max<int_fast32_t>(0, Min<int_fast32_t>(low - 16, static_cast<int_fast32_t>(currentDataIdx) - static_cast<int_fast32_t>(shortCircuit)));
+		uint_fast32_t scanHigh = Min<int_fast32_t>(data_size, Max<int_fast32_t>(high + 16, static_cast<int_fast32_t>(currentDataIdx + shortCircuit) + 1));
+
 		// Compute best scores for reaching each specific data index
 		uint_fast32_t dataDeltaScores[data_size];
-		for (uint_fast32_t idx = 0; idx < data_size; idx++)
+		for (uint_fast32_t idx = scanLow; idx < scanHigh; idx++)
 		{
 			dataDeltaScores[idx] = abs(static_cast<int_fast32_t>(currentDataIdx - idx));
 		}
@@ -686,7 +1431,7 @@ public:
 				for (int_fast32_t endDelta = -8; endDelta <= 8; endDelta++)
 				{
 					int_fast32_t endIdx = innerIdx + endDelta;
-					if (endIdx < 0 || endIdx >= data_size)
+					if (endIdx < static_cast<int_fast32_t>(scanLow) || endIdx >= static_cast<int_fast32_t>(scanHigh))
 					{
 						continue;
 					}
@@ -701,7 +1446,7 @@ public:
 		}
 
 		// Search through reaching each specific data index and directly modifying the data to match the next character
-		for (uint_fast32_t newDataIdx = 0; newDataIdx < data_size; newDataIdx++)
+		for (uint_fast32_t newDataIdx = scanLow; newDataIdx < scanHigh; newDataIdx++)
 		{
 			uint_fast32_t charScore = 1 + dataDeltaScores[newDataIdx] + abs(static_cast<int8_t>(c - currentData[newDataIdx]));
 
@@ -712,7 +1457,8 @@ public:
 
 			char oldData = currentData[newDataIdx];
 			currentData[newDataIdx] = c;
-			uint_fast32_t restScore = StringDistanceRecursive(target + 1, targetSize - 1, shortCircuit - charScore, currentData, newDataIdx);
+			uint_fast32_t restScore = StringDistanceRecursive(target + 1, targetSize - 1, shortCircuit - charScore, currentData, newDataIdx,
+				Min<int_fast32_t>(low, newDataIdx), Max<int_fast32_t>(high, newDataIdx + 1));
 			currentData[newDataIdx] = oldData;
 
 			if (charScore + restScore < bestScore)
@@ -733,7 +1479,8 @@ public:
 
 				char oldData = currentData[newDataIdx];
 				currentData[newDataIdx] = upperC;
-				uint_fast32_t restScore = StringDistanceRecursive(target + 1, targetSize - 1, shortCircuit - upperCharScore, currentData, newDataIdx);
+				uint_fast32_t restScore = StringDistanceRecursive(target + 1, targetSize - 1, shortCircuit - upperCharScore, currentData, newDataIdx,
+				Min<int_fast32_t>(low, newDataIdx), Max<int_fast32_t>(high, newDataIdx + 1));
 				currentData[newDataIdx] = oldData;
 
 				if (upperCharScore + restScore < bestScore)
@@ -748,14 +1495,28 @@ public:
 		return bestScore;
 	}
 
+	// Range of possibly nonzero cells, in the coordinates of StringDistance's copy of the tape
+	void StringDistanceBounds(int_fast32_t& low, int_fast32_t& high)
+	{
+		low = Max<int_fast32_t>(dataBoundLow, cache_data_size) - cache_data_size;
+		high = Min<int_fast32_t>(dataBoundHigh, data_size + cache_data_size) - cache_data_size;
+		if (low >= high)
+		{
+			low = high = dataIdx - cache_data_size;
+		}
+	}
+
 	std::string StringDistanceOutput(const char* target, uint_fast32_t targetSize, uint_fast32_t shortCircuit)
 	{
 		uint8_t currentData[data_size];
 		memcpy(currentData, data + cache_data_size, data_size);
-		return StringDistanceOutputRecursive(target, targetSize, shortCircuit, currentData, dataIdx - cache_data_size);
+		int_fast32_t low, high;
+		StringDistanceBounds(low, high);
+		return StringDistanceOutputRecursive(target, targetSize, shortCircuit, currentData, dataIdx - cache_data_size, low, high);
 	}
 
-	std::string StringDistanceOutputRecursive(const char* target, uint_fast32_t targetSize, uint_fast32_t shortCircuit, uint8_t* currentData, uint_fast32_t currentDataIdx)
+	std::string StringDistanceOutputRecursive(const char* target, uint_fast32_t targetSize, uint_fast32_t shortCircuit, uint8_t* currentData, uint_fast32_t currentDataIdx,
+		int_fast32_t low, int_fast32_t high)
 	{
 		if (targetSize == 0)
 		{
@@ -766,11 +1527,16 @@ public:
 		std::string bestProgram = std::string(shortCircuit + 1, ' ');
 		char c = target[0];
 
+		// Loops over the nonzero cells stop within 8 cells of them, and cells further than shortCircuit are too far to move to,
+		// so the cells past both are never picked
+		uint_fast32_t scanLow = Max<int_fast32_t>(0, Min<int_fast32_t>(low - 16, static_cast<int_fast32_t>(currentDataIdx) - static_cast<int_fast32_t>(shortCircuit)));
+		uint_fast32_t scanHigh = Min<int_fast32_t>(data_size, Max<int_fast32_t>(high + 16, static_cast<int_fast32_t>(currentDataIdx + shortCircuit) + 1));
+
 		// Compute best scores for reaching each specific data index
 		uint_fast32_t dataDeltaScores[data_size];
 		std::string dataDeltaPrograms[data_size];
 
-		for (uint_fast32_t idx = 0; idx < data_size; idx++)
+		for (uint_fast32_t idx = scanLow; idx < scanHigh; idx++)
 		{
 			dataDeltaScores[idx] = abs(static_cast<int_fast32_t>(currentDataIdx - idx));
 			dataDeltaPrograms[idx] = "";
@@ -808,7 +1574,7 @@ public:
 				for (int_fast32_t endDelta = -8; endDelta <= 8; endDelta++)
 				{
 					int_fast32_t endIdx = innerIdx + endDelta;
-					if (endIdx < 0 || endIdx >= data_size)
+					if (endIdx < static_cast<int_fast32_t>(scanLow) || endIdx >= static_cast<int_fast32_t>(scanHigh))
 					{
 						continue;
 					}
@@ -850,7 +1616,7 @@ public:
 		}
 
 		// Search through reaching each specific data index and directly modifying the data to match the next character
-		for (uint_fast32_t newDataIdx = 0; newDataIdx < data_size; newDataIdx++)
+		for (uint_fast32_t newDataIdx = scanLow; newDataIdx < scanHigh; newDataIdx++)
 		{
 			uint_fast32_t charScore = 1 + dataDeltaScores[newDataIdx] + abs(static_cast<int8_t>(c - currentData[newDataIdx]));
 			std::string charProgram = dataDeltaPrograms[newDataIdx];
@@ -872,7 +1638,8 @@ public:
 
 			char oldData = currentData[newDataIdx];
 			currentData[newDataIdx] = c;
-			std::string restProgram = StringDistanceOutputRecursive(target + 1, targetSize - 1, shortCircuit - charScore, currentData, newDataIdx);
+			std::string restProgram = StringDistanceOutputRecursive(target + 1, targetSize - 1, shortCircuit - charScore, currentData, newDataIdx,
+				Min<int_fast32_t>(low, newDataIdx), Max<int_fast32_t>(high, newDataIdx + 1));
 			uint_fast32_t restScore = restProgram.size();
 			currentData[newDataIdx] = oldData;
 
@@ -906,7 +1673,8 @@ public:
 
 				char oldData = currentData[newDataIdx];
 				currentData[newDataIdx] = upperC;
-				std::string restProgram = StringDistanceOutputRecursive(target + 1, targetSize - 1, shortCircuit - upperCharScore, currentData, newDataIdx);
+				std::string restProgram = StringDistanceOutputRecursive(target + 1, targetSize - 1, shortCircuit - upperCharScore, currentData, newDataIdx,
+				Min<int_fast32_t>(low, newDataIdx), Max<int_fast32_t>(high, newDataIdx + 1));
 				uint_fast32_t restScore = restProgram.size();
 				currentData[newDataIdx] = oldData;
 
@@ -949,8 +1717,10 @@ public:
 
 	void PrintData()
 	{
-		for (uint_fast32_t i = dataBoundLow; i <= dataBoundHigh; i++)
+		uint_fast32_t low = Min(dataBoundLow, dataIdx);
+		uint_fast32_t high = Max(dataBoundHigh, dataIdx + 1);
+		for (uint_fast32_t i = low; i < high; i++)
 			std::cout << std::setw(4) << (int)data[i];
-		std::cout << std::endl << std::string((dataIdx - dataBoundLow) * 4, ' ') << "  ^" << std::endl;
+		std::cout << std::endl << std::string((dataIdx - low) * 4, ' ') << "  ^" << std::endl;
 	}
 };
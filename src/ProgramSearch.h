@@ -3,6 +3,8 @@
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <assert.h>
 #include <chrono>
 #include "LinearIterator.h"
@@ -11,6 +13,9 @@
 #define THREAD_COUNT 16
 #define SIZE_START 16
 #define SHOW_ALL_PROGRAMS_LENGTH 85
+#define MIN_STEAL_COUNT 100000
+// Bump whenever the progress file layout or the meaning of the ranks it stores change, such as the skeletons CheckShape accepts
+#define PROGRESS_FILE_VERSION 2
 
 template<typename PIteratorT, typename CacheT>
 class ProgramSearch
@@ -106,6 +111,29 @@ private:
 	uint_fast64_t sizeCount;
 	static std::mutex lock;
 
+	// Each thread checks attention once between candidates; the rest of its slot is only used under lock
+	struct WorkSlot
+	{
+		std::atomic<bool> attention;
+		// thiefIdx waits for this thread to split its range
+		bool stealRequested;
+		uint_fast32_t thiefIdx;
+		// A save waits for this thread to publish its checkpoint
+		bool checkpointRequested;
+		bool idle;
+		uint_fast64_t remaining;
+		// [checkpointBegin, checkpointEnd) is left of this thread's range as of its last safe point, after checkpointWalked of it were walked
+		uint_fast64_t checkpointBegin, checkpointEnd, checkpointWalked;
+		// The range this thread was handed for its own steal request
+		bool answered;
+		uint_fast64_t begin, end;
+	};
+	WorkSlot work[THREAD_COUNT];
+	static std::condition_variable workChanged;
+	bool saving = false;
+	// Candidates of this size in ranges which are already done
+	uint_fast64_t completedCount;
+
 public:
 	std::string Find()
 	{
@@ -120,6 +148,8 @@ public:
 	bool FindSize(uint_fast32_t programSize)
 	{
 		this->programSize = programSize;
+		StartRanges(iterators[0].TotalCount(programSize));
+		ResetWork();
 		for (uint_fast32_t i = 0; i < THREAD_COUNT; i++)
 		{
 			if (threads[i]) delete threads[i];
@@ -143,45 +173,206 @@ private:
 		static const uint_fast32_t countUpdate = 1000000;
 
 		auto& iterator = iterators[threadIdx];
-		iterator.Start(programSize, threadIdx, THREAD_COUNT);
 
 		uint_fast32_t threadCount = 0;
-		while (iterator.Next())
+		do
 		{
-			if (++threadCount % countUpdate == 0)
+			while (iterator.Next())
 			{
-				lock.lock();
-				if (foundProgramResult)
+				if (work[threadIdx].attention.load(std::memory_order_relaxed))
+				{
+					Attend(threadIdx);
+				}
+
+				if (++threadCount % countUpdate == 0)
 				{
+					lock.lock();
+					if (foundProgramResult)
+					{
+						lock.unlock();
+						break;
+					}
+					this->count += countUpdate;
+					this->sizeCount += countUpdate;
+					work[threadIdx].remaining = iterator.Remaining();
+					if (printProgress) std::cout << std::setw(10) << this->count << " " << iterator.GetProgram() << std::endl;
 					lock.unlock();
-					break;
 				}
-				this->count += countUpdate;
-				this->sizeCount += countUpdate;
-				if (printProgress) std::cout << std::setw(10) << this->count << " " << iterator.GetProgram() << std::endl;
+
+				for (uint_fast32_t i = 0; i < inputs.size(); i++)
+				{
+					if (!iterator.Execute(inputs[i], input_sizes[i]))
+					{
+						goto fail;
+					}
+					if (!iterator.DataEqual(outputs[i], output_sizes[i]))
+					{
+						goto fail;
+					}
+				}
+
+				lock.lock();
+				this->foundProgramResult = true;
+				this->programResult = std::string(iterator.GetProgram());
 				lock.unlock();
+				break;
+
+			fail:;
 			}
+		}
+		while (StealWork(threadIdx));
+	}
+
+	// Hands out the candidates of this size as contiguous ranges of equal count
+	void StartRanges(uint_fast64_t total)
+	{
+		completedCount = 0;
+		for (uint_fast32_t i = 0; i < THREAD_COUNT; i++)
+		{
+			iterators[i].StartRange(programSize, total * i / THREAD_COUNT, total * (i + 1) / THREAD_COUNT);
+		}
+	}
+
+	void ResetWork()
+	{
+		for (uint_fast32_t i = 0; i < THREAD_COUNT; i++)
+		{
+			work[i].attention = false;
+			work[i].stealRequested = false;
+			work[i].checkpointRequested = false;
+			work[i].answered = false;
+			work[i].idle = false;
+			work[i].remaining = iterators[i].Remaining();
+			Checkpoint(i, false);
+		}
+	}
+
+	// Called by the thread owning the range at a safe point, after Next and before the candidate is used
+	void Attend(uint_fast32_t threadIdx)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto& slot = work[threadIdx];
+		if (slot.stealRequested)
+		{
+			Answer(threadIdx, true);
+		}
+		if (slot.checkpointRequested)
+		{
+			Checkpoint(threadIdx, false);
+		}
+		slot.attention = false;
+		workChanged.notify_all();
+	}
+
+	void Answer(uint_fast32_t threadIdx, bool split)
+	{
+		auto& slot = work[threadIdx];
+		auto& thief = work[slot.thiefIdx];
+		if (!split || !iterators[threadIdx].Split(MIN_STEAL_COUNT, thief.begin, thief.end))
+		{
+			thief.begin = thief.end = 0;
+		}
+		// The handed over range must be in a checkpoint before the thief gets to run it
+		thief.checkpointBegin = thief.begin;
+		thief.checkpointEnd = thief.end;
+		thief.checkpointWalked = 0;
+		thief.answered = true;
+		slot.remaining = iterators[threadIdx].Remaining();
+		slot.stealRequested = false;
+		Checkpoint(threadIdx, false);
+	}
+
+	void Checkpoint(uint_fast32_t threadIdx, bool currentDone)
+	{
+		auto& slot = work[threadIdx];
+		slot.checkpointWalked = iterators[threadIdx].Checkpoint(currentDone, slot.checkpointBegin, slot.checkpointEnd);
+		slot.checkpointRequested = false;
+	}
 
-			for (uint_fast32_t i = 0; i < inputs.size(); i++)
+	// Moves a thread whose range is done onto half of the largest range left; false once none is worth splitting
+	bool StealWork(uint_fast32_t threadIdx)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		auto& iterator = iterators[threadIdx];
+		auto& slot = work[threadIdx];
+
+		completedCount += iterator.currentCount;
+		iterator.currentCount = 0;
+		slot.idle = true;
+		if (slot.stealRequested)
+		{
+			Answer(threadIdx, false);
+		}
+		Checkpoint(threadIdx, false);
+		slot.attention = false;
+		slot.remaining = 0;
+		workChanged.notify_all();
+
+		while (!foundProgramResult)
+		{
+			int_fast32_t victimIdx = -1;
+			for (uint_fast32_t i = 0; i < THREAD_COUNT; i++)
 			{
-				if (!iterator.Execute(inputs[i], input_sizes[i]))
+				if (!work[i].idle && !work[i].stealRequested && work[i].remaining >= 2 * MIN_STEAL_COUNT
+					&& (victimIdx < 0 || work[i].remaining > work[victimIdx].remaining))
 				{
-					goto fail;
-				}
-				if (!iterator.DataEqual(outputs[i], output_sizes[i]))
-				{
-					goto fail;
+					victimIdx = i;
 				}
 			}
+			if (victimIdx < 0)
+			{
+				return false;
+			}
 
-			lock.lock();
-			this->foundProgramResult = true;
-			this->programResult = std::string(iterator.GetProgram());
-			lock.unlock();
-			break;
+			slot.answered = false;
+			work[victimIdx].thiefIdx = threadIdx;
+			work[victimIdx].stealRequested = true;
+			work[victimIdx].attention = true;
+			workChanged.wait(guard, [&]() { return slot.answered; });
+			if (slot.begin < slot.end)
+			{
+				iterator.StartRange(programSize, slot.begin, slot.end);
+				slot.idle = false;
+				slot.remaining = iterator.Remaining();
+				Checkpoint(threadIdx, false);
+				return true;
+			}
+		}
+		return false;
+	}
 
-		fail:;
+	void PrintStringResult(uint_fast32_t length, const std::string& program)
+	{
+		std::cout 
+			<< std::right << std::setw(3) << std::setfill(' ') << length
+			<< " " << program << std::endl;
+
+		std::ofstream file("output.txt", std::ofstream::app);
+		file
+			<< std::right << std::setw(3) << std::setfill(' ') << length
+			<< " " << program << std::endl;
+		file.close();
+	}
+
+	static std::string MirrorProgram(std::string program)
+	{
+		for (auto& c : program)
+		{
+			if (c == '<') c = '>';
+			else if (c == '>') c = '<';
 		}
+		return program;
+	}
+
+	// Candidates of this size walked so far by all threads
+	uint_fast64_t SizeProgress()
+	{
+		uint_fast64_t result = completedCount;
+		for (uint_fast32_t i = 0; i < THREAD_COUNT; i++)
+		{
+			result += iterators[i].currentCount;
+		}
+		return result;
 	}
 
 public:
@@ -212,6 +403,10 @@ public:
 		std::cout << " Calculating program count for size " << programSize << "...\r" << std::flush;
 		programSizeCount = iterator.TotalCount(programSize);
 		std::cout << std::endl << " Completed program count calculation for size " << programSize << std::endl;
+		std::cout << " Skeleton rules removed "
+			<< iterator.RemovedCount(programSize, PIteratorT::ShapeRule::DEAD_LOOP) << " dead loop, "
+			<< iterator.RemovedCount(programSize, PIteratorT::ShapeRule::EMPTY_LOOP) << " empty loop and "
+			<< iterator.RemovedCount(programSize, PIteratorT::ShapeRule::SINGLE_PASS_LOOP) << " single pass loop programs" << std::endl;
 	}
 
 	void SetupSize()
@@ -219,17 +414,13 @@ public:
 		std::cout << "Setting up size " << programSize << std::endl;
 
 		sizeStart = std::chrono::system_clock::now();
-		for (uint_fast32_t thread_idx = 0; thread_idx < THREAD_COUNT; thread_idx++)
-		{
-			auto& iterator = iterators[thread_idx];
-			iterator.Start(programSize, thread_idx, THREAD_COUNT);
-		}
+		CountSize();
+		StartRanges(programSizeCount);
 	}
 
 	void FindStringSize()
 	{
-		CountSize();
-
+		ResetWork();
 		for (uint_fast32_t i = 0; i < THREAD_COUNT; i++)
 		{
 			if (threads[i]) delete threads[i];
@@ -250,22 +441,78 @@ private:
 		auto& iterator = iterators[threadIdx];
 
 		uint_fast32_t threadCount = 0;
-		while (iterator.Next())
+		do
 		{
-			uint_fast32_t stringDist;
-
-			if (++threadCount % countUpdate == 0)
+			while (iterator.Next())
 			{
-				lock.lock();
-				this->count += countUpdate;
+				uint_fast32_t stringDist;
 
-				if (printProgress)
+				if (work[threadIdx].attention.load(std::memory_order_relaxed))
 				{
-					uint_fast64_t currentCount = 0;
-					for (int i = 0; i < THREAD_COUNT; i++)
+					Attend(threadIdx);
+				}
+
+				if (++threadCount % countUpdate == 0)
+				{
+					lock.lock();
+					this->count += countUpdate;
+					work[threadIdx].remaining = iterator.Remaining();
+
+					if (printProgress)
 					{
-						currentCount += iterators[i].currentCount;
+						uint_fast64_t currentCount = SizeProgress();
+
+						double proportion = static_cast<double>(currentCount) / static_cast<double>(programSizeCount);
+						auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now() - sizeStart).count();
+						uint_fast64_t remaining = static_cast<double>(elapsed) * (1-proportion) / proportion;
+
+						auto seconds = remaining % 60;
+						auto minutes = remaining / 60 % 60;
+						auto hours = remaining / 3600 % 24;
+						auto days = remaining / 86400;
+						
+						std::cout 
+							<< std::right
+							<< " " << programSize
+							<< " " << std::setw(10) << std::setprecision(6) << std::fixed << proportion * 100 << "%"
+							<< " " << iterator.GetProgram()
+							<< " Estimated remaining " << std::setw(3) << days << ":" << std::setfill('0') << std::setw(2) << hours << ":" << std::setw(2) << minutes << ":" << std::setw(2) << seconds << std::setfill(' ')
+							<< "          \r" << std::flush;
 					}
+					lock.unlock();
+				}
+
+				if (threadCount % countSave == 0)
+				{
+					SaveFindStringProgress(threadIdx, false);
+				}
+
+				if (!iterator.Execute(inputs[0], input_sizes[0]))
+				{
+					continue;
+				}
+
+				stringDist = iterator.StringDistance(outputs[0], output_sizes[0], SHOW_ALL_PROGRAMS_LENGTH - programSize);
+				if (stringDist + programSize > SHOW_ALL_PROGRAMS_LENGTH)
+				{
+					continue;
+				}
+
+				std::string postProgram = iterator.StringDistanceOutput(outputs[0], output_sizes[0], SHOW_ALL_PROGRAMS_LENGTH - programSize);
+				programResult = std::string(iterator.GetProgram()) + postProgram;
+
+				lock.lock();
+
+				PrintStringResult(stringDist + programSize, programResult);
+				// The walk skipped the mirror image, which with no input prints the same output from the reversed tape
+				if (input_sizes[0] == 0 && iterator.HasMirror())
+				{
+					PrintStringResult(stringDist + programSize, MirrorProgram(programResult));
+				}
+				
+				if (printProgress)
+				{
+					uint_fast64_t currentCount = SizeProgress();
 
 					double proportion = static_cast<double>(currentCount) / static_cast<double>(programSizeCount);
 					auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now() - sizeStart).count();
@@ -284,70 +531,13 @@ private:
 						<< " Estimated remaining " << std::setw(3) << days << ":" << std::setfill('0') << std::setw(2) << hours << ":" << std::setw(2) << minutes << ":" << std::setw(2) << seconds << std::setfill(' ')
 						<< "          \r" << std::flush;
 				}
-				lock.unlock();
-			}
-
-			if (threadCount % countSave == 0)
-			{
-				SaveFindStringProgress();
-			}
-
-			if (!iterator.Execute(inputs[0], input_sizes[0]))
-			{
-				continue;
-			}
-
-			stringDist = iterator.StringDistance(outputs[0], output_sizes[0], SHOW_ALL_PROGRAMS_LENGTH - programSize);
-			if (stringDist + programSize > SHOW_ALL_PROGRAMS_LENGTH)
-			{
-				continue;
-			}
-
-			std::string postProgram = iterator.StringDistanceOutput(outputs[0], output_sizes[0], SHOW_ALL_PROGRAMS_LENGTH - programSize);
-			programResult = std::string(iterator.GetProgram()) + postProgram;
-
-			lock.lock();
-
-			std::cout 
-				<< std::right << std::setw(3) << std::setfill(' ') << stringDist + programSize
-				<< " " << programResult << std::endl;
-
-			std::ofstream file("output.txt", std::ofstream::app);
-			file
-				<< std::right << std::setw(3) << std::setfill(' ') << stringDist + programSize
-				<< " " << programResult << std::endl;
-			file.close();
-			
-			if (printProgress)
-			{
-				uint_fast64_t currentCount = 0;
-				for (int i = 0; i < THREAD_COUNT; i++)
-				{
-					currentCount += iterators[i].currentCount;
-				}
 
-				double proportion = static_cast<double>(currentCount) / static_cast<double>(programSizeCount);
-				auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now() - sizeStart).count();
-				uint_fast64_t remaining = static_cast<double>(elapsed) * (1-proportion) / proportion;
+				lock.unlock();
 
-				auto seconds = remaining % 60;
-				auto minutes = remaining / 60 % 60;
-				auto hours = remaining / 3600 % 24;
-				auto days = remaining / 86400;
-				
-				std::cout 
-					<< std::right
-					<< " " << programSize
-					<< " " << std::setw(10) << std::setprecision(6) << std::fixed << proportion * 100 << "%"
-					<< " " << iterator.GetProgram()
-					<< " Estimated remaining " << std::setw(3) << days << ":" << std::setfill('0') << std::setw(2) << hours << ":" << std::setw(2) << minutes << ":" << std::setw(2) << seconds << std::setfill(' ')
-					<< "          \r" << std::flush;
+				SaveFindStringProgress(threadIdx, true);
 			}
-
-			lock.unlock();
-
-			SaveFindStringProgress();
 		}
+		while (StealWork(threadIdx));
 	}
 
 	std::string StringToHex(const std::string& input)
@@ -366,7 +556,19 @@ private:
 
 	std::string Filename()
 	{
-		std::string filename = "/home/ksabry/dev/bfbrute/progress/program_search";
+		return "/home/ksabry/dev/bfbrute/progress/program_search" + Settings();
+	}
+
+	// First line of a progress file; a file starting with any other line was written by another version or configuration
+	std::string ProgressHeader()
+	{
+		return "progress " + std::to_string(PROGRESS_FILE_VERSION) + " " + Settings();
+	}
+
+	// Everything the stored ranks depend on
+	std::string Settings()
+	{
+		std::string filename;
 
 		for (std::string input : inputs)
 		{
@@ -437,6 +639,16 @@ private:
 		filename += "_F";
 #endif
 
+#ifdef MIRROR_CANONICAL
+		filename += "_T";
+#else
+		filename += "_F";
+#endif
+
+		filename += "_" + std::to_string(CacheT::cache_size);
+		filename += "_o" + std::to_string(CACHE_ORDER_VERSION);
+		filename += "_v" + std::to_string(PROGRESS_FILE_VERSION);
+
 		return filename;
 	}
 
@@ -457,53 +669,100 @@ private:
 			return false;
 		}
 
+		std::string header;
+		if (!std::getline(file, header) || header != ProgressHeader())
+		{
+			std::cout << "Progress file was written by another version or configuration; starting from size " << SIZE_START << std::endl;
+			file.close();
+			lock.unlock();
+			return false;
+		}
+
 		int64_t elapsed;
 
 		file >> programSize;
 		file >> elapsed;
+		file >> completedCount;
 		sizeStart = std::chrono::system_clock::now() - std::chrono::seconds(elapsed);
 
 		std::cout << "Progress file found; resuming size " << programSize << " (0/" << THREAD_COUNT << " loaded)\r" << std::flush;
 
 		for (uint_fast32_t thread_idx = 0; thread_idx < THREAD_COUNT; thread_idx++)
 		{
-			if (!iterators[thread_idx].Deserialize(file))
+			uint_fast64_t begin, end;
+			if (!(file >> begin >> end))
 			{
 				std::cout << "Failed to load progress file; starting from size " << SIZE_START << std::endl;
 				file.close();
 				lock.unlock();
 				return false;
 			}
+			iterators[thread_idx].StartRange(programSize, begin, end);
 			std::cout << "Progress file found; resuming size " << programSize << " (" << thread_idx + 1 << "/" << THREAD_COUNT << " loaded)\r" << std::flush;
 		}
 
 		std::cout << std::endl;
 		file.close();
 		lock.unlock();
+
+		CountSize();
 		return true;
 	}
 
-	void SaveFindStringProgress()
+	// Called by a worker between candidates; every other busy thread publishes its checkpoint at its next safe point
+	void SaveFindStringProgress(uint_fast32_t threadIdx, bool currentDone)
 	{
-		lock.lock();
+		std::unique_lock<std::mutex> guard(lock);
+		if (saving)
+		{
+			return;
+		}
+		saving = true;
+
+		Checkpoint(threadIdx, currentDone);
+		for (uint_fast32_t i = 0; i < THREAD_COUNT; i++)
+		{
+			if (i != threadIdx && !work[i].idle)
+			{
+				work[i].checkpointRequested = true;
+				work[i].attention = true;
+			}
+		}
+		workChanged.wait(guard, [&]()
+		{
+			for (uint_fast32_t i = 0; i < THREAD_COUNT; i++)
+			{
+				if (work[i].checkpointRequested) return false;
+			}
+			return true;
+		});
 
 		std::string filename = Filename();
 		std::ofstream file(filename, std::ofstream::trunc);
 		
+		file << ProgressHeader() << "\n";
 		file << programSize << "\n";
 		int64_t elapsed = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now() - sizeStart).count();
-		file << elapsed << "\n\n";
+		file << elapsed << "\n";
+		uint_fast64_t walked = completedCount;
+		for (uint_fast32_t i = 0; i < THREAD_COUNT; i++)
+		{
+			walked += work[i].checkpointWalked;
+		}
+		file << walked << "\n\n";
 
 		for (uint_fast32_t i = 0; i < THREAD_COUNT; i++)
 		{
-			iterators[i].Serialize(file);
-			file << "\n\n";
+			file << work[i].checkpointBegin << " " << work[i].checkpointEnd << "\n";
 		}
 		file.close();
 
-		lock.unlock();
+		saving = false;
 	}
 };
 
 template<typename PIteratorT, typename CacheT>
 std::mutex ProgramSearch<PIteratorT, CacheT>::lock;
+
+template<typename PIteratorT, typename CacheT>
+std::condition_variable ProgramSearch<PIteratorT, CacheT>::workChanged;
@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <emmintrin.h>
 #include "AlignedData.h"
+#include "DataKernels.h"
 
 template<typename T>
 T Min(const T& left, const T& right)
@@ -27,10 +28,31 @@ bool AddData(AlignedData<data_size>& dest, const AlignedData<data_size>& srcFirs
 		return false;
 	dest.idx = newDataIndex;
 
-	int_fast32_t secondStart = Max(srcSecond.start + srcFirst.idx, lowDataIdx);
-	int_fast32_t secondEnd = Min(srcSecond.end + srcFirst.idx, highDataIdx);
-	dest.start = Min(srcFirst.start, secondStart);
-	dest.end = Max(srcFirst.end, secondEnd);
+	int_fast32_t secondStart = Max<int_fast32_t>(srcSecond.start + srcFirst.idx, lowDataIdx);
+	int_fast32_t secondEnd = Min<int_fast32_t>(srcSecond.end + srcFirst.idx, highDataIdx);
+	dest.start = Min<int_fast32_t>(srcFirst.start, secondStart);
+	dest.end = Max<int_fast32_t>(srcFirst.end, secondEnd);
+
+	if constexpr (data_size == 32)
+	{
+		// Both operands are zero outside their windows, so whole vector adds give the same bytes as the windowed loop below
+		// srcSecond is shifted by reading it back out of a zero padded copy
+		alignas(16) uint8_t padded[96];
+		__m128i zero = _mm_setzero_si128();
+		_mm_store_si128(reinterpret_cast<__m128i*>(padded), zero);
+		_mm_store_si128(reinterpret_cast<__m128i*>(padded + 16), zero);
+		_mm_store_si128(reinterpret_cast<__m128i*>(padded + 32), _mm_load_si128(reinterpret_cast<const __m128i*>(srcSecond.data)));
+		_mm_store_si128(reinterpret_cast<__m128i*>(padded + 48), _mm_load_si128(reinterpret_cast<const __m128i*>(srcSecond.data + 16)));
+		_mm_store_si128(reinterpret_cast<__m128i*>(padded + 64), zero);
+		_mm_store_si128(reinterpret_cast<__m128i*>(padded + 80), zero);
+
+		const uint8_t* shifted = padded + 32 - srcFirst.idx;
+		__m128i low = _mm_add_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(srcFirst.data)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(shifted)));
+		__m128i high = _mm_add_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(srcFirst.data + 16)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(shifted + 16)));
+		_mm_store_si128(reinterpret_cast<__m128i*>(dest.data), low);
+		_mm_store_si128(reinterpret_cast<__m128i*>(dest.data + 16), high);
+		return true;
+	}
 
 	memset(dest.data, 0, data_size);
 	if (srcFirst.end > srcFirst.start)
@@ -50,6 +72,61 @@ bool AddData(AlignedData<data_size>& dest, const AlignedData<data_size>& srcFirs
 	return true;
 }
 
+template<uint_fast32_t data_size>
+inline void ExpandWindow(AlignedData<data_size>& dest, const EffectColumns& columns, uint_fast32_t index)
+{
+	int_fast32_t start = columns.start[index];
+	int_fast32_t end = columns.end[index];
+	memset(dest.data, 0, data_size);
+	if (end > start)
+	{
+		memcpy(&dest.data[start + data_size / 2], columns.windows + columns.offset[index], end - start);
+	}
+	dest.idx = columns.idx[index];
+	dest.start = start;
+	dest.end = end;
+}
+
+// Index of the first byte in data[from, to) which is zero, or nonzero if zero is false; to if there is none
+template<bool zero>
+inline uint_fast32_t FindFirst(const uint8_t* data, uint_fast32_t from, uint_fast32_t to)
+{
+	__m128i zeros = _mm_setzero_si128();
+	uint_fast32_t i = from;
+	for (; i + 16 <= to; i += 16)
+	{
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i)), zeros));
+		if (!zero)
+			mask ^= 0xFFFF;
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	for (; i < to; i++)
+		if ((data[i] == 0) == zero)
+			return i;
+	return to;
+}
+
+// Index of the last byte in data[from, to) which is zero, or nonzero if zero is false; to if there is none
+template<bool zero>
+inline uint_fast32_t FindLast(const uint8_t* data, uint_fast32_t from, uint_fast32_t to)
+{
+	__m128i zeros = _mm_setzero_si128();
+	uint_fast32_t i = to;
+	for (; i >= from + 16; i -= 16)
+	{
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i - 16)), zeros));
+		if (!zero)
+			mask ^= 0xFFFF;
+		if (mask != 0)
+			return i - 16 + (31 - __builtin_clz(mask));
+	}
+	while (i > from)
+		if ((data[--i] == 0) == zero)
+			return i;
+	return to;
+}
+
 template<uint_fast32_t data_size>
 void PrintData(uint8_t* data)
 {